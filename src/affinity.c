@@ -0,0 +1,139 @@
+#define _GNU_SOURCE
+#include "affinity.h"
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+const char *placement_names[PLACE_COUNT] = {"none", "compact", "cores", "scatter"};
+
+static placement_t sort_policy;
+
+/**
+ * Read one integer from a sysfs topology file of the given CPU
+ * @return The value, or -1 if the file is missing
+ */
+static int topology_read(int cpu, const char *name) {
+    char path[128];
+    int value = -1;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    if (fscanf(file, "%d", &value) != 1) {
+        value = -1;
+    }
+    fclose(file);
+    return value;
+}
+
+/**
+ * Order CPUs by the sort keys of the current policy, the CPU id breaks ties
+ */
+static int cpu_info_cmp(const void *a, const void *b) {
+    const cpu_info_t *x = a, *y = b;
+    int kx[3], ky[3], i;
+    switch (sort_policy) {
+        case PLACE_CORES:
+            kx[0] = x->smt, kx[1] = x->package, kx[2] = x->core;
+            ky[0] = y->smt, ky[1] = y->package, ky[2] = y->core;
+            break;
+        case PLACE_SCATTER:
+            kx[0] = x->smt, kx[1] = x->core, kx[2] = x->package;
+            ky[0] = y->smt, ky[1] = y->core, ky[2] = y->package;
+            break;
+        default:
+            kx[0] = x->package, kx[1] = x->core, kx[2] = x->smt;
+            ky[0] = y->package, ky[1] = y->core, ky[2] = y->smt;
+            break;
+    }
+    for (i = 0; i < 3; i++) {
+        if (kx[i] != ky[i]) {
+            return kx[i] < ky[i] ? -1 : 1;
+        }
+    }
+    return x->cpu - y->cpu;
+}
+
+/**
+ * List the CPUs the process may run on, in the order the placement policy hands them to threads
+ * Core and SMT ranks are derived from core_id and physical_package_id in sysfs,
+ * a CPU without topology information is treated as a core of its own in package 0
+ * Not thread-safe, meant to be called once before a run
+ * @param policy The placement policy
+ * @param cpus Output array of CPU ids
+ * @param max The capacity of cpus
+ * @return The number of CPUs stored, 0 if the affinity mask can not be read
+ */
+int topology_order(placement_t policy, int *cpus, int max) {
+    cpu_set_t set;
+    int i, j, n = 0;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        perror("sched_getaffinity");
+        return 0;
+    }
+    cpu_info_t *info = malloc(sizeof(cpu_info_t) * CPU_SETSIZE);
+    int *core_id = malloc(sizeof(int) * CPU_SETSIZE);
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (!CPU_ISSET(i, &set)) {
+            continue;
+        }
+        info[n].cpu = i;
+        info[n].package = topology_read(i, "physical_package_id");
+        core_id[n] = topology_read(i, "core_id");
+        if (info[n].package < 0 || core_id[n] < 0) {
+            info[n].package = 0;
+            core_id[n] = 100000 + i;
+        }
+        n++;
+    }
+
+    // core ids are sparse and only unique inside a package, turn them into dense ranks
+    for (i = 0; i < n; i++) {
+        info[i].core = 0;
+        info[i].smt = 0;
+        for (j = 0; j < n; j++) {
+            if (info[j].package != info[i].package) {
+                continue;
+            }
+            if (core_id[j] == core_id[i] && info[j].cpu < info[i].cpu) {
+                info[i].smt++;
+            }
+        }
+        for (j = 0; j < n; j++) { // count distinct smaller core ids in the same package
+            int k, first = 1;
+            if (info[j].package != info[i].package || core_id[j] >= core_id[i]) {
+                continue;
+            }
+            for (k = 0; k < j; k++) {
+                if (info[k].package == info[j].package && core_id[k] == core_id[j]) {
+                    first = 0;
+                    break;
+                }
+            }
+            info[i].core += first;
+        }
+    }
+
+    sort_policy = policy;
+    qsort(info, n, sizeof(cpu_info_t), cpu_info_cmp);
+    for (i = 0; i < n && i < max; i++) {
+        cpus[i] = info[i].cpu;
+    }
+    free(core_id);
+    free(info);
+    return i;
+}
+
+/**
+ * Pin the calling thread to one CPU
+ * @param cpu The logical CPU id
+ * @return 0 on success, an error number on failure
+ */
+int affinity_pin(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
@@ -0,0 +1,30 @@
+#ifndef P4_AFFINITY_H
+#define P4_AFFINITY_H
+
+/**
+ * Thread placement policies, they decide the order in which CPUs are handed to threads
+ */
+typedef enum {
+    PLACE_NONE = 0, /**< do not pin, the scheduler may migrate threads freely */
+    PLACE_COMPACT,  /**< fill SMT siblings of a core, then the next core, then the next socket */
+    PLACE_CORES,    /**< one thread per physical core socket by socket, SMT siblings only when cores run out */
+    PLACE_SCATTER,  /**< alternate sockets and cores, SMT siblings only when cores run out */
+    PLACE_COUNT
+} placement_t;
+
+extern const char *placement_names[PLACE_COUNT];
+
+/**
+ * The position of one CPU in the machine topology, read from sysfs
+ */
+typedef struct {
+    int cpu;     /**< the logical CPU id */
+    int package; /**< the physical package (socket) id */
+    int core;    /**< the rank of the core inside its package */
+    int smt;     /**< the rank of the CPU among the SMT siblings of its core */
+} cpu_info_t;
+
+int topology_order(placement_t policy, int *cpus, int max);
+int affinity_pin(int cpu);
+
+#endif //P4_AFFINITY_H
@@ -0,0 +1,495 @@
+#define _GNU_SOURCE
+#include "dhash.h"
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Requests a client buffers for one shard before publishing them without an explicit flush
+ */
+#define DHASH_BATCH 32
+
+/**
+ * Idle rounds a server or a waiting client spins before it sleeps on its doorbell
+ */
+#define DHASH_SPIN 1024
+
+/**
+ * Allocate the slots of a ring
+ * @return 0 on success, -1 on allocation failure
+ */
+static int dhash_ring_init(dhash_ring_t *ring, unsigned int size) {
+    ring->slots = malloc(sizeof(dhash_msg_t) * size);
+    if (ring->slots == NULL) {
+        perror("dhash ring allocation failed!");
+        return -1;
+    }
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->fill = 0;
+    return 0;
+}
+
+/**
+ * Select the shard of a key, from the high bits of a Fibonacci hash
+ * Buckets inside the shard are selected by the low bits, so the two choices don't correlate
+ */
+static inline int dhash_shard_of(dhash_t *dh, unsigned int key) {
+    return (int)(((unsigned long long)(key * 2654435769u) * (unsigned)dh->shards) >> 32);
+}
+
+/**
+ * Allocate the bucket chains of a shard, the bucket count is rounded up to a power of two
+ * @return 0 on success, -1 on failure
+ */
+static int dhash_shard_init(dhash_shard_t *shard, int buckets) {
+    unsigned int pow2 = 1;
+    if (buckets < 1) {
+        fprintf(stderr, "dhash bucket size %d out of range!\n", buckets);
+        return -1;
+    }
+    while (pow2 < (unsigned int)buckets) {
+        pow2 <<= 1;
+    }
+    shard->buckets = calloc(pow2, sizeof(node_t *));
+    if (shard->buckets == NULL) {
+        perror("dhash bucket allocation failed!");
+        return -1;
+    }
+    shard->mask = pow2 - 1;
+    shard->size = 0;
+    return 0;
+}
+
+/**
+ * Free every chain and the buckets of a shard
+ */
+static void dhash_shard_destroy(dhash_shard_t *shard) {
+    unsigned int i;
+    for (i = 0; i <= shard->mask; i++) {
+        node_t *cur = shard->buckets[i];
+        while (cur != NULL) {
+            node_t *next = cur->next;
+            free(cur);
+            cur = next;
+        }
+    }
+    free(shard->buckets);
+}
+
+/**
+ * Insert a key at the head of its chain, only called by the server of the shard
+ * @return 1 if the key is inserted, 0 if the node could not be allocated
+ */
+static inline int dhash_shard_insert(dhash_shard_t *shard, unsigned int key) {
+    node_t **bucket = &shard->buckets[key & shard->mask];
+    node_t *node = malloc(sizeof(node_t));
+    if (node == NULL) {
+        return 0;
+    }
+    node->key = key;
+    node->next = *bucket;
+    *bucket = node;
+    __atomic_store_n(&shard->size, shard->size + 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/**
+ * Delete one copy of a key, only called by the server of the shard
+ * @return 1 if a copy is deleted, 0 if the key is not found
+ */
+static inline int dhash_shard_delete(dhash_shard_t *shard, unsigned int key) {
+    node_t **link = &shard->buckets[key & shard->mask];
+    while (*link != NULL) {
+        node_t *cur = *link;
+        if (cur->key == key) {
+            *link = cur->next;
+            free(cur);
+            __atomic_store_n(&shard->size, shard->size - 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+        link = &cur->next;
+    }
+    return 0;
+}
+
+/**
+ * Look up a key, only called by the server of the shard
+ * @return 1 if the key is present, 0 otherwise
+ */
+static inline int dhash_shard_lookup(dhash_shard_t *shard, unsigned int key) {
+    node_t *cur = shard->buckets[key & shard->mask];
+    while (cur != NULL && cur->key != key) {
+        cur = cur->next;
+    }
+    return cur != NULL;
+}
+
+/**
+ * Wake up the thread sleeping on a doorbell, if it sleeps
+ * The caller has just published a ring end with a sequentially consistent store, which pairs with the sleeper
+ * setting sleeping before its last check, so either the sleeper sees the ring or we see the sleeper
+ * @param doorbell The futex word to bump
+ * @param sleeping Whether the owner of the doorbell sleeps
+ */
+static inline void dhash_ring_bell(unsigned *doorbell, unsigned *sleeping) {
+    if (__atomic_load_n(sleeping, __ATOMIC_SEQ_CST)) {
+        __atomic_fetch_add(doorbell, 1, __ATOMIC_SEQ_CST);
+        futex_wake(doorbell, 1);
+    }
+}
+
+/**
+ * Make the buffered requests of a client to a shard visible to the server
+ */
+static inline void dhash_publish(dhash_t *dh, int client, int shard) {
+    dhash_ring_t *ring = &dh->requests[client * dh->shards + shard];
+    if (ring->fill != ring->tail) {
+        __atomic_store_n(&ring->tail, ring->fill, __ATOMIC_SEQ_CST);
+        dhash_ring_bell(&dh->shard[shard].doorbell, &dh->shard[shard].sleeping);
+    }
+}
+
+/**
+ * Apply all published requests of a client to the shard and publish their completions
+ * @return The number of requests served
+ */
+static int dhash_serve(dhash_t *dh, dhash_shard_t *shard, int client) {
+    dhash_ring_t *in = &dh->requests[client * dh->shards + shard->id];
+    dhash_ring_t *out = &dh->replies[client * dh->shards + shard->id];
+    unsigned long head = in->head;
+    unsigned long tail = __atomic_load_n(&in->tail, __ATOMIC_ACQUIRE);
+    unsigned long fill = out->fill;
+    int n = (int)(tail - head);
+    if (n == 0) {
+        return 0;
+    }
+    for (; head != tail; head++) {
+        dhash_msg_t msg = in->slots[head & in->mask];
+        switch (msg.op) {
+            case DHASH_INSERT:
+                msg.result = (unsigned char)dhash_shard_insert(shard, msg.key);
+                break;
+            case DHASH_DELETE:
+                msg.result = (unsigned char)dhash_shard_delete(shard, msg.key);
+                break;
+            default:
+                msg.result = (unsigned char)dhash_shard_lookup(shard, msg.key);
+                break;
+        }
+        out->slots[fill++ & out->mask] = msg;
+    }
+    out->fill = fill;
+    __atomic_store_n(&in->head, head, __ATOMIC_RELEASE);
+    __atomic_store_n(&out->tail, fill, __ATOMIC_SEQ_CST);
+    dhash_ring_bell(&dh->client[client].doorbell, &dh->client[client].sleeping);
+    return n;
+}
+
+/**
+ * The server thread of a shard
+ * Round-robin over the request rings of all clients, spin for DHASH_SPIN idle rounds and then sleep until a client
+ * rings the doorbell
+ * @param args A pointer to the dhash_shard_t to serve
+ */
+static void *dhash_server(void *args) {
+    dhash_shard_t *shard = args;
+    dhash_t *dh = shard->owner;
+    int c, served, idle = 0;
+    if (shard->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(shard->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    while (!__atomic_load_n(&dh->stop, __ATOMIC_SEQ_CST)) {
+        for (c = 0, served = 0; c < dh->clients; c++) {
+            served += dhash_serve(dh, shard, c);
+        }
+        if (served > 0) {
+            idle = 0;
+            continue;
+        }
+        if (++idle < DHASH_SPIN) {
+            cpu_pause();
+            continue;
+        }
+        unsigned seen = __atomic_load_n(&shard->doorbell, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&shard->sleeping, 1, __ATOMIC_SEQ_CST);
+        for (c = 0; c < dh->clients; c++) { // recheck after announcing the sleep
+            dhash_ring_t *in = &dh->requests[c * dh->shards + shard->id];
+            if (__atomic_load_n(&in->tail, __ATOMIC_SEQ_CST) != in->head) {
+                break;
+            }
+        }
+        if (c == dh->clients && !__atomic_load_n(&dh->stop, __ATOMIC_SEQ_CST)) {
+            futex_wait(&shard->doorbell, seen);
+        }
+        __atomic_store_n(&shard->sleeping, 0, __ATOMIC_RELAXED);
+        idle = 0;
+    }
+    return NULL;
+}
+
+/**
+ * Allocate a zeroed array aligned to a cache line
+ * The size is rounded up to a whole number of cache lines, since elements may be padded to more than one line
+ * and aligned_alloc only accepts power of two alignments
+ * @param count The number of elements
+ * @param size The size of one element
+ * @return The array, NULL on failure
+ */
+static void *dhash_alloc(size_t count, size_t size) {
+    void *mem;
+    size_t bytes = (count * size + 63) & ~(size_t)63;
+    if (posix_memalign(&mem, 64, bytes ? bytes : 64) != 0) {
+        return NULL;
+    }
+    memset(mem, 0, bytes);
+    return mem;
+}
+
+/**
+ * Stop the started servers and free everything dhash_init allocated
+ * Arrays are zeroed when allocated, so unset slots and counters are NULL and free ignores them
+ * @param dh A pointer to a delegated hash table
+ * @param started The number of shards whose server thread runs
+ * @param hashed The number of shards whose buckets are allocated
+ */
+static void dhash_release(dhash_t *dh, int started, int hashed) {
+    int i;
+    __atomic_store_n(&dh->stop, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; i < started; i++) {
+        __atomic_fetch_add(&dh->shard[i].doorbell, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&dh->shard[i].doorbell, 1);
+        pthread_join(dh->shard[i].thread, NULL);
+    }
+    for (i = 0; i < hashed; i++) {
+        dhash_shard_destroy(&dh->shard[i]);
+    }
+    for (i = 0; dh->requests != NULL && dh->replies != NULL && i < dh->shards * dh->clients; i++) {
+        free(dh->requests[i].slots);
+        free(dh->replies[i].slots);
+    }
+    for (i = 0; dh->client != NULL && i < dh->clients; i++) {
+        free(dh->client[i].inflight);
+    }
+    free(dh->requests);
+    free(dh->replies);
+    free(dh->client);
+    free(dh->shard);
+}
+
+/**
+ * Initialize a delegated hash table and start its server threads
+ * On failure everything allocated and started so far is released again
+ * @param dh A pointer to a delegated hash table
+ * @param shards The number of shards, one server thread each
+ * @param clients The number of client indexes, each used by one thread at a time
+ * @param buckets The total bucket count, split evenly over the shards and rounded up to a power of two per shard
+ * @param depth Requests a client may have in flight per shard, rounded up to a power of two
+ * @param cpus CPUs to pin the servers to, cpus[i] for shard i, may be NULL to leave them unpinned
+ * @return 0 on success, -1 on failure
+ */
+int dhash_init(dhash_t *dh, int shards, int clients, int buckets, unsigned int depth, const int *cpus) {
+    int i;
+    unsigned int size = 1;
+    while (size < depth) {
+        size <<= 1;
+    }
+    dh->shards = shards;
+    dh->clients = clients;
+    dh->depth = size;
+    dh->stop = 0;
+    dh->shard = dhash_alloc(shards, sizeof(dhash_shard_t));
+    dh->client = dhash_alloc(clients, sizeof(dhash_client_t));
+    dh->requests = dhash_alloc((size_t)shards * clients, sizeof(dhash_ring_t));
+    dh->replies = dhash_alloc((size_t)shards * clients, sizeof(dhash_ring_t));
+    if (dh->shard == NULL || dh->client == NULL || dh->requests == NULL || dh->replies == NULL) {
+        perror("dhash allocation failed!");
+        dhash_release(dh, 0, 0);
+        return -1;
+    }
+    for (i = 0; i < shards * clients; i++) {
+        if (dhash_ring_init(&dh->requests[i], size) < 0 || dhash_ring_init(&dh->replies[i], size) < 0) {
+            dhash_release(dh, 0, 0);
+            return -1;
+        }
+    }
+    for (i = 0; i < clients; i++) {
+        dh->client[i].inflight = calloc(shards, sizeof(unsigned));
+        if (dh->client[i].inflight == NULL) {
+            perror("dhash allocation failed!");
+            dhash_release(dh, 0, 0);
+            return -1;
+        }
+        dh->client[i].outstanding = 0;
+        dh->client[i].next = 0;
+        dh->client[i].doorbell = 0;
+        dh->client[i].sleeping = 0;
+    }
+    for (i = 0; i < shards; i++) {
+        dhash_shard_t *shard = &dh->shard[i];
+        if (dhash_shard_init(shard, (buckets + shards - 1) / shards) < 0) {
+            dhash_release(dh, i, i);
+            return -1;
+        }
+        shard->owner = dh;
+        shard->id = i;
+        shard->cpu = cpus != NULL ? cpus[i] : -1;
+        shard->doorbell = 0;
+        shard->sleeping = 0;
+        if (pthread_create(&shard->thread, NULL, dhash_server, shard) != 0) {
+            perror("dhash server creation failed!");
+            dhash_release(dh, i, i + 1);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Queue a request of the given client, without blocking
+ * Requests are buffered and published to the server in batches of DHASH_BATCH,
+ * dhash_flush, dhash_poll and dhash_wait publish the rest
+ * @param dh A pointer to a delegated hash table
+ * @param client The client index
+ * @param op The operation
+ * @param key The key to operate on
+ * @param tag Returned with the completion of this request
+ * @return 1 if the request is queued, 0 if the client already has depth requests in flight to the key's shard,
+ *         in which case it must collect completions first
+ */
+int dhash_submit(dhash_t *dh, int client, dhash_op_t op, unsigned int key, unsigned long tag) {
+    int shard = dhash_shard_of(dh, key);
+    dhash_client_t *self = &dh->client[client];
+    if (self->inflight[shard] >= dh->depth) {
+        return 0;
+    }
+    dhash_ring_t *ring = &dh->requests[client * dh->shards + shard];
+    dhash_msg_t *msg = &ring->slots[ring->fill & ring->mask];
+    msg->tag = tag;
+    msg->key = key;
+    msg->op = (unsigned char)op;
+    msg->result = 0;
+    ring->fill++;
+    self->inflight[shard]++;
+    self->outstanding++;
+    if (ring->fill - ring->tail >= DHASH_BATCH) {
+        dhash_publish(dh, client, shard);
+    }
+    return 1;
+}
+
+/**
+ * Publish all buffered requests of the given client
+ * @param dh A pointer to a delegated hash table
+ * @param client The client index
+ */
+void dhash_flush(dhash_t *dh, int client) {
+    int i;
+    for (i = 0; i < dh->shards; i++) {
+        dhash_publish(dh, client, i);
+    }
+}
+
+/**
+ * Move the available completions of a client into out, starting from a different shard every time
+ * @return The number of completions collected
+ */
+static int dhash_collect(dhash_t *dh, int client, dhash_msg_t *out, int max) {
+    int i, n = 0;
+    dhash_client_t *self = &dh->client[client];
+    for (i = 0; i < dh->shards && n < max; i++) {
+        int shard = (self->next + i) % dh->shards;
+        dhash_ring_t *ring = &dh->replies[client * dh->shards + shard];
+        unsigned long head = ring->head;
+        unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            continue;
+        }
+        for (; head != tail && n < max; head++) {
+            out[n++] = ring->slots[head & ring->mask];
+            self->inflight[shard]--;
+            self->outstanding--;
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+    self->next = (self->next + 1) % dh->shards;
+    return n;
+}
+
+/**
+ * Collect completed requests of the given client without blocking, publishing buffered requests first
+ * @param dh A pointer to a delegated hash table
+ * @param client The client index
+ * @param out Output array of completions, in completion order per shard
+ * @param max The capacity of out
+ * @return The number of completions stored into out
+ */
+int dhash_poll(dhash_t *dh, int client, dhash_msg_t *out, int max) {
+    dhash_flush(dh, client);
+    return dhash_collect(dh, client, out, max);
+}
+
+/**
+ * Collect completed requests of the given client, waiting until at least one is available
+ * Spin for DHASH_SPIN rounds first, then sleep until a server rings the doorbell of the client
+ * @param dh A pointer to a delegated hash table
+ * @param client The client index
+ * @param out Output array of completions, in completion order per shard
+ * @param max The capacity of out
+ * @return The number of completions stored into out, 0 only if the client has nothing in flight
+ */
+int dhash_wait(dhash_t *dh, int client, dhash_msg_t *out, int max) {
+    int i, n;
+    dhash_client_t *self = &dh->client[client];
+    dhash_flush(dh, client);
+    if (self->outstanding == 0) {
+        return 0;
+    }
+    for (;;) {
+        for (i = 0; i < DHASH_SPIN; i++) {
+            if ((n = dhash_collect(dh, client, out, max)) > 0) {
+                return n;
+            }
+            cpu_pause();
+        }
+        unsigned seen = __atomic_load_n(&self->doorbell, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&self->sleeping, 1, __ATOMIC_SEQ_CST);
+        if ((n = dhash_collect(dh, client, out, max)) == 0) { // recheck after announcing the sleep
+            futex_wait(&self->doorbell, seen);
+            n = dhash_collect(dh, client, out, max);
+        }
+        __atomic_store_n(&self->sleeping, 0, __ATOMIC_RELAXED);
+        if (n > 0) {
+            return n;
+        }
+    }
+}
+
+/**
+ * Get the total number of keys over all shards
+ * Read from the counts the servers maintain, so it does not involve them and may lag behind
+ * @param dh A pointer to a delegated hash table
+ * @return The total number of keys
+ */
+long long dhash_size(dhash_t *dh) {
+    int i;
+    long long size = 0;
+    for (i = 0; i < dh->shards; i++) {
+        size += __atomic_load_n(&dh->shard[i].size, __ATOMIC_RELAXED);
+    }
+    return size;
+}
+
+/**
+ * Stop the servers and destroy the delegated hash table
+ * Requests still in flight are dropped, clients should wait for their completions first
+ * @param dh The delegated hash table to be destroyed
+ */
+void dhash_destroy(dhash_t *dh) {
+    dhash_release(dh, dh->shards, dh->shards);
+}
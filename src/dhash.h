@@ -0,0 +1,94 @@
+#ifndef P4_DHASH_H
+#define P4_DHASH_H
+
+#include "list.h"
+#include <pthread.h>
+
+/**
+ * Operations a client can delegate to a shard
+ */
+typedef enum {
+    DHASH_INSERT = 0, /**< insert the key, result is 1 unless the node could not be allocated */
+    DHASH_DELETE,     /**< delete one copy of the key, result is 1 if one was deleted */
+    DHASH_LOOKUP      /**< look up the key, result is 1 if it is present */
+} dhash_op_t;
+
+/**
+ * A request travelling to a shard, sent back with result filled as its completion
+ */
+typedef struct {
+    unsigned long tag;   /**< chosen by the client, identifies the request in its completion */
+    unsigned int key;    /**< the key to operate on */
+    unsigned char op;    /**< a dhash_op_t */
+    unsigned char result; /**< the outcome, only meaningful in completions */
+} dhash_msg_t;
+
+/**
+ * A single-producer single-consumer ring of messages
+ * Capacity is never checked, the client keeps at most depth requests in flight per shard instead,
+ * which bounds both the request ring and the completion ring of the pair
+ */
+typedef struct {
+    dhash_msg_t *slots;  /**< the slots, capacity is a power of two */
+    unsigned long mask;  /**< capacity - 1 */
+    unsigned long head __attribute__((aligned(64))); /**< the next slot to read, only written by the consumer */
+    unsigned long tail __attribute__((aligned(64))); /**< the published end of the ring, only written by the producer */
+    unsigned long fill;  /**< the next slot to write, ahead of tail while a batch is unpublished, producer private */
+} dhash_ring_t;
+
+struct _dhash_t;
+
+/**
+ * A shard owns the buckets of its keys, only its server thread ever touches them
+ * so the chains are walked and changed without locks or atomic read-modify-writes
+ */
+typedef struct {
+    node_t **buckets;       /**< the bucket chains of this shard, duplicates are kept like hash_insert */
+    unsigned int mask;      /**< bucket count - 1, the bucket count is a power of two */
+    long long size;         /**< the number of keys, only written by the server, read by dhash_size */
+    struct _dhash_t *owner; /**< the delegated table the shard belongs to */
+    int id;                 /**< the shard index */
+    int cpu;                /**< the CPU the server is pinned to, -1 if not pinned */
+    pthread_t thread;       /**< the server thread */
+    unsigned doorbell;      /**< futex word bumped by clients when the server sleeps */
+    unsigned sleeping;      /**< whether the server sleeps on doorbell */
+} __attribute__((aligned(64))) dhash_shard_t;
+
+/**
+ * The private state of a client, only used by the thread acting as this client
+ */
+typedef struct {
+    unsigned *inflight;     /**< requests submitted to each shard and not yet collected */
+    long outstanding;       /**< requests in flight over all shards */
+    int next;               /**< the shard polled first next time, so no completion ring starves */
+    unsigned doorbell;      /**< futex word bumped by servers when the client sleeps in dhash_wait */
+    unsigned sleeping;      /**< whether the client sleeps on doorbell */
+} __attribute__((aligned(64))) dhash_client_t;
+
+/**
+ * A delegated hash table
+ * The keys are split into shards by hash, each shard is owned by one server thread
+ * Clients send requests over a request ring per (client, shard) pair and collect completions from a completion ring
+ * per pair, so no bucket or lock is ever shared between cores
+ * A client index must only be used by one thread at a time, different clients are thread-safe
+ */
+typedef struct _dhash_t {
+    int shards;              /**< the number of shards and server threads */
+    int clients;             /**< the number of clients */
+    unsigned int depth;      /**< requests a client may have in flight per shard */
+    dhash_shard_t *shard;    /**< the shards */
+    dhash_client_t *client;  /**< the clients */
+    dhash_ring_t *requests;  /**< request rings, index with client * shards + shard */
+    dhash_ring_t *replies;   /**< completion rings, index with client * shards + shard */
+    int stop;                /**< set by dhash_destroy to stop the servers */
+} dhash_t;
+
+int dhash_init(dhash_t *dh, int shards, int clients, int buckets, unsigned int depth, const int *cpus);
+int dhash_submit(dhash_t *dh, int client, dhash_op_t op, unsigned int key, unsigned long tag);
+void dhash_flush(dhash_t *dh, int client);
+int dhash_poll(dhash_t *dh, int client, dhash_msg_t *out, int max);
+int dhash_wait(dhash_t *dh, int client, dhash_msg_t *out, int max);
+long long dhash_size(dhash_t *dh);
+void dhash_destroy(dhash_t *dh);
+
+#endif //P4_DHASH_H
@@ -1,17 +1,131 @@
 #include "hash.h"
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+const char *hash_func_names[HASH_FUNC_COUNT] = {"mod", "fibonacci", "murmur", "xxhash"};
+
+/**
+ * Map a key to its bucket with the given hash function
+ * @param func The hash function
+ * @param size The bucket size, must be a power of two for all functions but HASH_FUNC_MOD
+ * @param shift 32 - log2(size)
+ * @param key The key to be mapped
+ * @return The bucket index
+ */
+static inline unsigned int hash_index(hash_func_t func, unsigned int size, unsigned int shift, unsigned int key) {
+    unsigned int h;
+    switch (func) {
+        case HASH_FUNC_FIBONACCI:
+            // a 64-bit shift so that shift = 32 (single bucket) is well defined
+            return (unsigned int)((unsigned long long)(key * 2654435769u) >> shift);
+        case HASH_FUNC_MURMUR:
+            h = key;
+            h ^= h >> 16;
+            h *= 0x85ebca6bu;
+            h ^= h >> 13;
+            h *= 0xc2b2ae35u;
+            h ^= h >> 16;
+            return h & (size - 1);
+        case HASH_FUNC_XXHASH:
+            h = 374761393u + 4u + key * 3266489917u; // PRIME32_5 + len + input * PRIME32_3
+            h = ((h << 17) | (h >> 15)) * 668265263u;   // rotl 17, PRIME32_4
+            h ^= h >> 15;
+            h *= 2246822519u;
+            h ^= h >> 13;
+            h *= 3266489917u;
+            h ^= h >> 16;
+            return h & (size - 1);
+        default:
+            return (size & (size - 1)) == 0 ? key & (size - 1) : key % size;
+    }
+}
+
+/**
+ * Map a key to its bucket in the given hash table
+ */
+static inline unsigned int hash_bucket(hash_t *hash, unsigned int key) {
+    return hash_index(hash->func, (unsigned int)hash->bucket_size, hash->shift, key);
+}
+
+/**
+ * Calculate 32 - log2(size) for a power of two size
+ */
+static inline unsigned int hash_shift(unsigned int size) {
+    return 32 - (unsigned int)__builtin_ctz(size);
+}
+
+static __thread int hash_stripe_id = -1;
+static unsigned hash_stripe_next = 0;
 
 /**
- * Initialize the hash table with given bucket size
+ * Add a delta to the stripe of the calling thread
+ * Threads are assigned to stripes round-robin on their first update
+ * @param hash A pointer to hash table
+ * @param count The change of key count
+ * @param sum The change of key sum
+ */
+static inline void hash_account(hash_t *hash, long long count, long long sum) {
+    if (hash_stripe_id < 0) {
+        hash_stripe_id = __sync_fetch_and_add(&hash_stripe_next, 1) % HASH_STRIPES;
+    }
+    hash_stripe_t *stripe = &hash->stripes[hash_stripe_id];
+    __atomic_fetch_add(&stripe->count, count, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stripe->sum, sum, __ATOMIC_RELAXED);
+}
+
+/**
+ * Initialize the hash table with given bucket size, using module as the hash function
  * @param hash A pointer to hash table
  * @param size Designated bucket size
+ * @return 0 on success, -1 on failure
  */
-void hash_init(hash_t *hash, int size) {
+int hash_init(hash_t *hash, int size) {
+    return hash_init_func(hash, size, HASH_FUNC_MOD);
+}
+
+/**
+ * Initialize the hash table with given bucket size and hash function
+ * For all functions but HASH_FUNC_MOD, the bucket size is rounded up to a power of two,
+ * so it must not exceed HASH_MAX_BUCKETS
+ * @param hash A pointer to hash table
+ * @param size Designated bucket size
+ * @param func The hash function
+ * @return 0 on success, -1 if the size is out of range or the allocation failed
+ */
+int hash_init_func(hash_t *hash, int size, hash_func_t func) {
     int i;
+    if (size < 1 || (func != HASH_FUNC_MOD && size > HASH_MAX_BUCKETS)) {
+        fprintf(stderr, "hash bucket size %d out of range!\n", size);
+        return -1;
+    }
+    if (func != HASH_FUNC_MOD) {
+        int pow2 = 1;
+        while (pow2 < size) {
+            pow2 <<= 1;
+        }
+        size = pow2;
+    }
     hash->bucket_size = size;
-    hash->lists = malloc(sizeof(list_t)*size);
+    hash->func = func;
+    hash->shift = (size & (size - 1)) == 0 ? hash_shift((unsigned int)size) : 0;
+    hash->lists = malloc(sizeof(list_t) * (size_t)size);
+    hash->stripes = aligned_alloc(sizeof(hash_stripe_t), sizeof(hash_stripe_t) * HASH_STRIPES);
+    if (hash->lists == NULL || hash->stripes == NULL) {
+        perror("hash allocation failed!");
+        free(hash->lists);
+        free(hash->stripes);
+        return -1;
+    }
+    memset(hash->stripes, 0, sizeof(hash_stripe_t) * HASH_STRIPES);
     for (i = 0; i < size; i++) {
         list_init(&hash->lists[i]);
     }
+    return 0;
 }
 
 /**
@@ -21,8 +135,24 @@ void hash_init(hash_t *hash, int size) {
  * @param key A key to be inserted
  */
 void hash_insert(hash_t *hash, unsigned int key) {
-    int bucket = key % hash->bucket_size;
+    int bucket = hash_bucket(hash, key);
     list_insert(&hash->lists[bucket], key);
+    hash_account(hash, 1, key);
+}
+
+/**
+ * Insert a key into hash table unless it is already present
+ * @param hash The pointer to hash table
+ * @param key The key to be inserted
+ * @return 1 if the key is inserted, 0 if it is already present
+ */
+int hash_insert_unique(hash_t *hash, unsigned int key) {
+    int bucket = hash_bucket(hash, key);
+    if (list_insert_unique(&hash->lists[bucket], key)) {
+        hash_account(hash, 1, key);
+        return 1;
+    }
+    return 0;
 }
 
 /**
@@ -30,10 +160,15 @@ void hash_insert(hash_t *hash, unsigned int key) {
  * If multiple keys detected in hash table, only delete one of them
  * @param hash The pointer to hash table
  * @param key The key to be deleted
+ * @return 1 if a key is deleted, 0 if the key is not found
  */
-void hash_delete(hash_t *hash, unsigned int key) {
-    int bucket = key % hash->bucket_size;
-    list_delete(&hash->lists[bucket], key);
+int hash_delete(hash_t *hash, unsigned int key) {
+    int bucket = hash_bucket(hash, key);
+    if (list_delete(&hash->lists[bucket], key)) {
+        hash_account(hash, -1, -(long long)key);
+        return 1;
+    }
+    return 0;
 }
 
 /**
@@ -43,7 +178,7 @@ void hash_delete(hash_t *hash, unsigned int key) {
  * @return A pointer to the node with given key, should cast to node_t type before use.
  */
 void* hash_lookup(hash_t *hash, unsigned int key) {
-    int bucket = key % hash->bucket_size;
+    int bucket = hash_bucket(hash, key);
     return list_lookup(&hash->lists[bucket], key);
 }
 
@@ -57,4 +192,723 @@ void hash_destroy(hash_t *hash) {
         list_destroy(&hash->lists[i]);
     }
     free(hash->lists);
+    free(hash->stripes);
+}
+
+/**
+ * Get the number of keys in hash table from the maintained stripes
+ * This is O(HASH_STRIPES) and takes no lock, the result may lag behind concurrent updates
+ * @param hash A pointer to hash table
+ * @return The number of keys
+ */
+long long hash_size(hash_t *hash) {
+    int i;
+    long long res = 0;
+    for (i = 0; i < HASH_STRIPES; i++) {
+        res += __atomic_load_n(&hash->stripes[i].count, __ATOMIC_RELAXED);
+    }
+    return res;
+}
+
+/**
+ * Get the sum of keys in hash table from the maintained stripes
+ * This is O(HASH_STRIPES) and takes no lock, the result may lag behind concurrent updates
+ * @param hash A pointer to hash table
+ * @return The sum of keys
+ */
+long long hash_key_sum(hash_t *hash) {
+    int i;
+    long long res = 0;
+    for (i = 0; i < HASH_STRIPES; i++) {
+        res += __atomic_load_n(&hash->stripes[i].sum, __ATOMIC_RELAXED);
+    }
+    return res;
+}
+
+
+/**
+ * A key position tagged with its bucket, used to group batched keys by bucket
+ */
+typedef struct {
+    int bucket; /**< the bucket the key falls into */
+    int index;  /**< the position of the key in the caller's array */
+} hash_slot_t;
+
+/**
+ * Order slots by bucket, keeping the caller's order for keys of the same bucket
+ */
+static int hash_slot_cmp(const void *a, const void *b) {
+    const hash_slot_t *x = a, *y = b;
+    if (x->bucket != y->bucket) {
+        return x->bucket < y->bucket ? -1 : 1;
+    }
+    return x->index - y->index;
+}
+
+/**
+ * Tag every key with its bucket and sort them so that keys of the same bucket are adjacent
+ * @param hash A pointer to hash table
+ * @param keys The keys to be grouped
+ * @param n The number of keys
+ * @return A malloc'ed array of n slots, should be freed by caller
+ */
+static hash_slot_t *hash_group(hash_t *hash, const unsigned int *keys, int n) {
+    int i;
+    hash_slot_t *slots = malloc(sizeof(hash_slot_t) * n);
+    for (i = 0; i < n; i++) {
+        slots[i].bucket = hash_bucket(hash, keys[i]);
+        slots[i].index = i;
+    }
+    qsort(slots, n, sizeof(hash_slot_t), hash_slot_cmp);
+    return slots;
+}
+
+/**
+ * Find the end of the group starting at begin, and prefetch the bucket of the following group
+ * so that its list_t line is in cache by the time the current group is done
+ * Only the list_t itself is prefetched, following its head pointer here would be a demand load of the very line
+ * being prefetched, and an unlocked read of a field writers change
+ */
+static int hash_group_end(hash_t *hash, hash_slot_t *slots, int begin, int n) {
+    int end = begin + 1;
+    while (end < n && slots[end].bucket == slots[begin].bucket) {
+        end++;
+    }
+    if (end < n) {
+        __builtin_prefetch(&hash->lists[slots[end].bucket], 1);
+    }
+    return end;
+}
+
+/**
+ * Insert a batch of keys into hash table
+ * Keys are grouped by bucket so that every bucket lock is taken only once
+ * @param hash A pointer to hash table
+ * @param keys The keys to be inserted
+ * @param n The number of keys
+ */
+void hash_insert_batch(hash_t *hash, const unsigned int *keys, int n) {
+    int i, j, end;
+    long long sum = 0;
+    if (n <= 0) {
+        return;
+    }
+    hash_slot_t *slots = hash_group(hash, keys, n);
+    unsigned int *group = malloc(sizeof(unsigned int) * n);
+    for (i = 0; i < n; i = end) {
+        end = hash_group_end(hash, slots, i, n);
+        for (j = i; j < end; j++) {
+            group[j - i] = keys[slots[j].index];
+            sum += group[j - i];
+        }
+        list_insert_batch(&hash->lists[slots[i].bucket], group, end - i);
+    }
+    hash_account(hash, n, sum);
+    free(group);
+    free(slots);
+}
+
+/**
+ * Delete a batch of keys from hash table
+ * Keys are grouped by bucket so that every bucket lock is taken only once
+ * @param hash A pointer to hash table
+ * @param keys The keys to be deleted
+ * @param n The number of keys
+ * @return The number of keys actually deleted
+ */
+int hash_delete_batch(hash_t *hash, const unsigned int *keys, int n) {
+    int i, j, end, cnt = 0;
+    long long sum = 0, removed;
+    if (n <= 0) {
+        return 0;
+    }
+    hash_slot_t *slots = hash_group(hash, keys, n);
+    unsigned int *group = malloc(sizeof(unsigned int) * n);
+    for (i = 0; i < n; i = end) {
+        end = hash_group_end(hash, slots, i, n);
+        for (j = i; j < end; j++) {
+            group[j - i] = keys[slots[j].index];
+        }
+        cnt += list_delete_batch(&hash->lists[slots[i].bucket], group, end - i, &removed);
+        sum += removed;
+    }
+    hash_account(hash, -cnt, -sum);
+    free(group);
+    free(slots);
+    return cnt;
+}
+
+/**
+ * Find a batch of keys in hash table
+ * Keys are grouped by bucket so that every bucket lock is taken only once
+ * @param hash A pointer to hash table
+ * @param keys The keys to find
+ * @param n The number of keys
+ * @param results Output array of at least n node pointers, results[i] is the node of keys[i] or NULL
+ */
+void hash_lookup_batch(hash_t *hash, const unsigned int *keys, int n, void **results) {
+    int i, j, end;
+    if (n <= 0) {
+        return;
+    }
+    hash_slot_t *slots = hash_group(hash, keys, n);
+    unsigned int *group = malloc(sizeof(unsigned int) * n);
+    void **found = malloc(sizeof(void *) * n);
+    for (i = 0; i < n; i = end) {
+        end = hash_group_end(hash, slots, i, n);
+        for (j = i; j < end; j++) {
+            group[j - i] = keys[slots[j].index];
+        }
+        list_lookup_batch(&hash->lists[slots[i].bucket], group, end - i, found);
+        for (j = i; j < end; j++) {
+            results[slots[j].index] = found[j - i];
+        }
+    }
+    free(found);
+    free(group);
+    free(slots);
+}
+
+/**
+ * A range of buckets scanned by one worker, together with its partial results
+ */
+typedef struct {
+    hash_t *hash;                         /**< the hash table to scan */
+    int begin, end;                       /**< the bucket range [begin, end) */
+    int locked;                           /**< whether the caller already holds all bucket locks */
+    void (*fn)(unsigned int, void *);     /**< callback for every key, may be NULL */
+    void *arg;                            /**< the extra argument of callback */
+    int collect;                          /**< whether keys should be copied into the keys buffer */
+    int count;                            /**< partial number of keys */
+    long long sum;                        /**< partial sum of keys */
+    unsigned int *keys;                   /**< collected keys */
+    int capacity;                         /**< the capacity of keys buffer */
+    int started;                          /**< whether a worker thread runs the task and has to be joined */
+} hash_task_t;
+
+/**
+ * Take the shared end of a bucket lock, falls back to the exclusive lock for non-rw lock types
+ */
+static void hash_bucket_lock(list_t *list) {
+#if defined(LOCK_RWLOCK) || defined(LOCK_PRWLOCK)
+    rwlock_rdlock(&list->lock);
+#else
+    lock_acquire(&list->lock);
+#endif
+}
+
+/**
+ * Scan every key of the buckets in a task
+ * @param args A pointer to hash_task_t
+ */
+static void *hash_scan_worker(void *args) {
+    hash_task_t *task = args;
+    int i;
+    for (i = task->begin; i < task->end; i++) {
+        list_t *list = &task->hash->lists[i];
+        if (task->fn == NULL && !task->collect) { // aggregates only, the maintained fields are enough
+            task->count += list_count(list);
+            task->sum += list_sum(list);
+            continue;
+        }
+        if (!task->locked) {
+            hash_bucket_lock(list);
+        }
+        node_t *cur = list->head;
+        while (cur != NULL) {
+            task->count++;
+            task->sum += cur->key;
+            if (task->fn != NULL) {
+                task->fn(cur->key, task->arg);
+            }
+            if (task->collect) {
+                if (task->count > task->capacity) {
+                    task->capacity = task->capacity ? task->capacity * 2 : 64;
+                    task->keys = realloc(task->keys, sizeof(unsigned int) * task->capacity);
+                }
+                task->keys[task->count - 1] = cur->key;
+            }
+            cur = cur->next;
+        }
+        if (!task->locked) {
+            lock_release(&list->lock);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Split the buckets into ranges and scan them in parallel
+ * The caller thread works on the first range itself, and on any range whose worker could not be created
+ * @return A malloc'ed array of tasks holding partial results, its length is stored in *n,
+ *         NULL if the tasks could not be allocated
+ */
+static hash_task_t *hash_scan(hash_t *hash, int threads, int consistent,
+                              void (*fn)(unsigned int, void *), void *arg, int collect, int *n) {
+    int i;
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > hash->bucket_size) {
+        threads = hash->bucket_size > 0 ? hash->bucket_size : 1;
+    }
+    hash_task_t *tasks = calloc(threads, sizeof(hash_task_t));
+    if (tasks == NULL && threads > 1) { // fall back to scanning everything in the caller
+        threads = 1;
+        tasks = calloc(threads, sizeof(hash_task_t));
+    }
+    if (tasks == NULL) {
+        perror("hash scan allocation failed!");
+        *n = 0;
+        return NULL;
+    }
+    pthread_t *workers = threads > 1 ? malloc(sizeof(pthread_t) * threads) : NULL;
+
+    if (consistent) { // lock in bucket order, so concurrent scans can not deadlock
+        for (i = 0; i < hash->bucket_size; i++) {
+            hash_bucket_lock(&hash->lists[i]);
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        tasks[i].hash = hash;
+        tasks[i].begin = (int)((long long)hash->bucket_size * i / threads);
+        tasks[i].end = (int)((long long)hash->bucket_size * (i + 1) / threads);
+        tasks[i].locked = consistent;
+        tasks[i].fn = fn;
+        tasks[i].arg = arg;
+        tasks[i].collect = collect;
+    }
+    for (i = 1; i < threads; i++) {
+        tasks[i].started = workers != NULL && pthread_create(&workers[i], NULL, hash_scan_worker, &tasks[i]) == 0;
+        if (!tasks[i].started) {
+            hash_scan_worker(&tasks[i]);
+        }
+    }
+    hash_scan_worker(&tasks[0]);
+    for (i = 1; i < threads; i++) {
+        if (tasks[i].started) {
+            pthread_join(workers[i], NULL);
+        }
+    }
+    if (consistent) {
+        for (i = 0; i < hash->bucket_size; i++) {
+            lock_release(&hash->lists[i].lock);
+        }
+    }
+
+    free(workers);
+    *n = threads;
+    return tasks;
+}
+
+/**
+ * Count all keys in hash table
+ * @param hash A pointer to hash table
+ * @param threads The number of worker threads
+ * @param consistent Whether to hold all bucket locks during the scan
+ * @return The total number of keys, -1 if the scan could not be allocated
+ */
+int hash_count(hash_t *hash, int threads, int consistent) {
+    int i, n, cnt = 0;
+    if (!consistent) {
+        return (int)hash_size(hash);
+    }
+    hash_task_t *tasks = hash_scan(hash, threads, consistent, NULL, NULL, 0, &n);
+    if (tasks == NULL) {
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        cnt += tasks[i].count;
+    }
+    free(tasks);
+    return cnt;
+}
+
+/**
+ * Calculate the sum of all keys in hash table
+ * @param hash A pointer to hash table
+ * @param threads The number of worker threads
+ * @param consistent Whether to hold all bucket locks during the scan
+ * @return The sum of all keys, -1 if the scan could not be allocated
+ */
+long long hash_sum(hash_t *hash, int threads, int consistent) {
+    int i, n;
+    long long res = 0;
+    if (!consistent) {
+        return hash_key_sum(hash);
+    }
+    hash_task_t *tasks = hash_scan(hash, threads, consistent, NULL, NULL, 0, &n);
+    if (tasks == NULL) {
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        res += tasks[i].sum;
+    }
+    free(tasks);
+    return res;
+}
+
+/**
+ * Call fn on every key in hash table
+ * fn runs under the bucket lock and concurrently in several workers, so it must be thread-safe
+ * and must not modify the hash table
+ * @param hash A pointer to hash table
+ * @param threads The number of worker threads
+ * @param consistent Whether to hold all bucket locks during the scan
+ * @param fn The callback
+ * @param arg The extra argument passed to fn
+ * @return 0 on success, -1 if the scan could not be allocated and fn was not called
+ */
+int hash_for_each(hash_t *hash, int threads, int consistent, void (*fn)(unsigned int key, void *arg), void *arg) {
+    int n;
+    hash_task_t *tasks = hash_scan(hash, threads, consistent, fn, arg, 0, &n);
+    if (tasks == NULL) {
+        return -1;
+    }
+    free(tasks);
+    return 0;
+}
+
+/**
+ * Copy all keys of hash table into a new array, in bucket order
+ * @param hash A pointer to hash table
+ * @param threads The number of worker threads
+ * @param consistent Whether to hold all bucket locks during the scan
+ * @param keys Output pointer of a malloc'ed key array, should be freed by caller
+ * @return The number of keys copied, -1 if the memory could not be allocated, *keys is then NULL
+ */
+int hash_snapshot(hash_t *hash, int threads, int consistent, unsigned int **keys) {
+    int i, n, cnt = 0;
+    hash_task_t *tasks = hash_scan(hash, threads, consistent, NULL, NULL, 1, &n);
+    *keys = NULL;
+    if (tasks == NULL) {
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        cnt += tasks[i].count;
+    }
+    *keys = malloc(sizeof(unsigned int) * (cnt ? cnt : 1));
+    if (*keys == NULL) {
+        perror("hash snapshot allocation failed!");
+        for (i = 0; i < n; i++) {
+            free(tasks[i].keys);
+        }
+        free(tasks);
+        return -1;
+    }
+    cnt = 0;
+    for (i = 0; i < n; i++) {
+        if (tasks[i].count) {
+            memcpy(*keys + cnt, tasks[i].keys, sizeof(unsigned int) * tasks[i].count);
+        }
+        cnt += tasks[i].count;
+        free(tasks[i].keys);
+    }
+    free(tasks);
+    return cnt;
+}
+
+/**
+ * Save a consistent snapshot of hash table into a file
+ * All bucket locks are held while the keys are copied out, the file is written after they are released
+ * @param hash A pointer to hash table
+ * @param path The path of the snapshot file, will be truncated
+ * @return 0 on success, -1 on failure
+ */
+int hash_save(hash_t *hash, const char *path) {
+    int i;
+    hash_image_header_t header;
+    unsigned long long *offsets = malloc(sizeof(unsigned long long) * (hash->bucket_size + 1));
+    unsigned int *keys;
+
+    for (i = 0; i < hash->bucket_size; i++) {
+        hash_bucket_lock(&hash->lists[i]);
+    }
+    offsets[0] = 0;
+    for (i = 0; i < hash->bucket_size; i++) {
+        offsets[i + 1] = offsets[i] + hash->lists[i].size;
+    }
+    keys = malloc(sizeof(unsigned int) * (offsets[hash->bucket_size] ? offsets[hash->bucket_size] : 1));
+    for (i = 0; i < hash->bucket_size; i++) {
+        // the list is head-inserted, fill backwards to store keys in insertion order
+        unsigned long long pos = offsets[i + 1];
+        node_t *cur = hash->lists[i].head;
+        while (cur != NULL) {
+            keys[--pos] = cur->key;
+            cur = cur->next;
+        }
+    }
+    for (i = 0; i < hash->bucket_size; i++) {
+        lock_release(&hash->lists[i].lock);
+    }
+
+    header.magic = HASH_IMAGE_MAGIC;
+    header.version = HASH_IMAGE_VERSION;
+    header.bucket_size = (unsigned int)hash->bucket_size;
+    header.func = hash->func;
+    header.key_count = offsets[hash->bucket_size];
+
+    int ret = 0;
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        perror("hash_save: fopen");
+        ret = -1;
+    } else {
+        if (fwrite(&header, sizeof(header), 1, file) != 1
+            || fwrite(offsets, sizeof(unsigned long long), hash->bucket_size + 1, file) != hash->bucket_size + 1
+            || fwrite(keys, sizeof(unsigned int), header.key_count, file) != header.key_count) {
+            perror("hash_save: fwrite");
+            ret = -1;
+        }
+        if (fclose(file) != 0) {
+            perror("hash_save: fclose");
+            ret = -1;
+        }
+    }
+    free(keys);
+    free(offsets);
+    return ret;
+}
+
+/**
+ * Check that the bucket offsets of a mapped snapshot start at 0, never decrease, end at the key count
+ * and give no bucket more keys than list_insert_batch accepts, so every bucket range lies inside keys[]
+ * The header and the length of the mapping must have been checked already
+ */
+static int hash_image_offsets_valid(const hash_image_t *image) {
+    unsigned int i, size = image->header->bucket_size;
+    if (image->offsets[0] != 0 || image->offsets[size] != image->header->key_count) {
+        return 0;
+    }
+    for (i = 0; i < size; i++) {
+        if (image->offsets[i] > image->offsets[i + 1] || image->offsets[i + 1] - image->offsets[i] > INT_MAX) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Map a snapshot file read-only and validate its layout
+ * @param image The image to be opened
+ * @param path The path of the snapshot file
+ * @return 0 on success, -1 on failure
+ */
+int hash_image_open(hash_image_t *image, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("hash_image_open: open");
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        perror("hash_image_open: fstat");
+        close(fd);
+        return -1;
+    }
+    if ((unsigned long)st.st_size < sizeof(hash_image_header_t)) {
+        fprintf(stderr, "hash_image_open: %s is too short\n", path);
+        close(fd);
+        return -1;
+    }
+    image->length = (unsigned long)st.st_size;
+    image->base = mmap(NULL, image->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image->base == MAP_FAILED) {
+        perror("hash_image_open: mmap");
+        return -1;
+    }
+
+    image->header = image->base;
+    image->offsets = (const unsigned long long *)(image->header + 1);
+    image->keys = (const unsigned int *)(image->offsets + image->header->bucket_size + 1);
+    if (image->header->magic != HASH_IMAGE_MAGIC || image->header->version != HASH_IMAGE_VERSION
+        || image->header->bucket_size == 0 || image->header->bucket_size > INT_MAX
+        || image->header->func >= HASH_FUNC_COUNT
+        || (image->header->func != HASH_FUNC_MOD && (image->header->bucket_size & (image->header->bucket_size - 1)))
+        || image->header->key_count > image->length / sizeof(unsigned int)
+        || image->length != sizeof(hash_image_header_t)
+                            + sizeof(unsigned long long) * (image->header->bucket_size + 1ULL)
+                            + sizeof(unsigned int) * image->header->key_count
+        || !hash_image_offsets_valid(image)) {
+        fprintf(stderr, "hash_image_open: %s is not a valid snapshot\n", path);
+        munmap(image->base, image->length);
+        return -1;
+    }
+    image->shift = (image->header->bucket_size & (image->header->bucket_size - 1)) == 0
+                   ? hash_shift(image->header->bucket_size) : 0;
+    return 0;
+}
+
+/**
+ * Find a given key in a mapped snapshot, without any lock
+ * @param image A pointer to an opened image
+ * @param key The key to find
+ * @return A pointer to the key inside the mapping, or NULL if not found
+ */
+const unsigned int *hash_image_lookup(hash_image_t *image, unsigned int key) {
+    unsigned int bucket = hash_index(image->header->func, image->header->bucket_size, image->shift, key);
+    unsigned long long i;
+    for (i = image->offsets[bucket]; i < image->offsets[bucket + 1]; i++) {
+        if (image->keys[i] == key) {
+            return &image->keys[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Unmap a snapshot
+ * @param image A pointer to an opened image
+ */
+void hash_image_close(hash_image_t *image) {
+    munmap(image->base, image->length);
+    image->base = NULL;
+}
+
+/**
+ * A range of buckets converted from the image into live lists by one loader
+ */
+typedef struct {
+    hash_t *hash;         /**< the hash table to fill */
+    hash_image_t *image;  /**< the mapped snapshot */
+    int begin, end;       /**< the bucket range [begin, end) */
+    long long sum;        /**< the sum of loaded keys */
+    int started;          /**< whether a loader thread runs the task and has to be joined */
+} hash_load_task_t;
+
+/**
+ * Splice every bucket of a range directly from the mapped key array
+ * @param args A pointer to hash_load_task_t
+ */
+static void *hash_load_worker(void *args) {
+    hash_load_task_t *task = args;
+    int i;
+    unsigned long long j;
+    for (i = task->begin; i < task->end; i++) {
+        unsigned long long begin = task->image->offsets[i], end = task->image->offsets[i + 1];
+        for (j = begin; j < end; j++) {
+            task->sum += task->image->keys[j];
+        }
+        list_insert_batch(&task->hash->lists[i], task->image->keys + begin, (int)(end - begin));
+    }
+    return NULL;
+}
+
+/**
+ * Initialize a hash table from a snapshot file
+ * The bucket size is taken from the file, the buckets are filled by the given number of threads,
+ * a range whose loader thread can not be created is filled by the caller
+ * The hash table should not be initialized before
+ * @param hash A pointer to hash table
+ * @param path The path of the snapshot file
+ * @param threads The number of loader threads
+ * @return 0 on success, -1 on failure
+ */
+int hash_load(hash_t *hash, const char *path, int threads) {
+    hash_image_t image;
+    int i;
+    long long sum = 0;
+    if (hash_image_open(&image, path) < 0) {
+        return -1;
+    }
+    if (hash_init_func(hash, (int)image.header->bucket_size, (hash_func_t)image.header->func) < 0) {
+        hash_image_close(&image);
+        return -1;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > hash->bucket_size) {
+        threads = hash->bucket_size;
+    }
+
+    hash_load_task_t *tasks = calloc(threads, sizeof(hash_load_task_t));
+    if (tasks == NULL && threads > 1) { // fall back to loading everything in the caller
+        threads = 1;
+        tasks = calloc(threads, sizeof(hash_load_task_t));
+    }
+    if (tasks == NULL) {
+        perror("hash load allocation failed!");
+        hash_destroy(hash);
+        hash_image_close(&image);
+        return -1;
+    }
+    pthread_t *workers = threads > 1 ? malloc(sizeof(pthread_t) * threads) : NULL;
+    for (i = 0; i < threads; i++) {
+        tasks[i].hash = hash;
+        tasks[i].image = &image;
+        tasks[i].begin = (int)((long long)hash->bucket_size * i / threads);
+        tasks[i].end = (int)((long long)hash->bucket_size * (i + 1) / threads);
+    }
+    for (i = 1; i < threads; i++) {
+        tasks[i].started = workers != NULL && pthread_create(&workers[i], NULL, hash_load_worker, &tasks[i]) == 0;
+        if (!tasks[i].started) {
+            hash_load_worker(&tasks[i]);
+        }
+    }
+    hash_load_worker(&tasks[0]);
+    for (i = 1; i < threads; i++) {
+        if (tasks[i].started) {
+            pthread_join(workers[i], NULL);
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        sum += tasks[i].sum;
+    }
+    hash_account(hash, (long long)image.header->key_count, sum);
+
+    free(workers);
+    free(tasks);
+    hash_image_close(&image);
+    return 0;
+}
+
+/**
+ * Collect chain length, memory and operation statistics of hash table
+ * Bucket fields are read without locks, so the report may mix states under concurrent updates
+ * @param hash A pointer to hash table
+ * @param stats The statistics to be filled, should be released by hash_stats_free
+ */
+void hash_stats(hash_t *hash, hash_stats_t *stats) {
+    int i;
+    double square = 0;
+    memset(stats, 0, sizeof(hash_stats_t));
+    stats->bucket_size = hash->bucket_size;
+    stats->longest_bucket = -1;
+    stats->bucket_ops = malloc(sizeof(unsigned long) * hash->bucket_size);
+    for (i = 0; i < hash->bucket_size; i++) {
+        list_t *list = &hash->lists[i];
+        int len = list_count(list);
+        stats->keys += len;
+        square += (double)len * len;
+        stats->histogram[len < HASH_HIST_SIZE - 1 ? len : HASH_HIST_SIZE - 1]++;
+        if (len > stats->longest_chain || stats->longest_bucket < 0) {
+            stats->longest_chain = len;
+            stats->longest_bucket = i;
+        }
+#if defined(LIST_STATS)
+        stats->bucket_ops[i] = __atomic_load_n(&list->ops, __ATOMIC_RELAXED);
+        stats->ops += stats->bucket_ops[i];
+#else
+        stats->bucket_ops[i] = 0;
+#endif
+    }
+    if (hash->bucket_size > 0) {
+        stats->load_factor = (double)stats->keys / hash->bucket_size;
+        square = square / hash->bucket_size - stats->load_factor * stats->load_factor;
+        stats->chain_stddev = square > 0 ? sqrt(square) : 0;
+    }
+    stats->node_bytes = sizeof(node_t) * (unsigned long)stats->keys;
+    stats->bucket_bytes = sizeof(list_t) * (unsigned long)hash->bucket_size;
+    stats->lock_bytes = sizeof(lock_t) * (unsigned long)hash->bucket_size;
+}
+
+/**
+ * Release the memory held by a statistics report
+ * @param stats The statistics filled by hash_stats
+ */
+void hash_stats_free(hash_stats_t *stats) {
+    free(stats->bucket_ops);
+    stats->bucket_ops = NULL;
 }
@@ -2,22 +2,137 @@
 #define P4_HASH_H
 
 #include "list.h"
+#include <pthread.h>
+
+#define HASH_STRIPES 16
+
+/**
+ * The largest bucket size that can be rounded up to a power of two within an int
+ */
+#define HASH_MAX_BUCKETS (1 << 30)
+
+/**
+ * A slice of the table-wide key count and key sum
+ * Every thread adds its deltas to one stripe, the stripes are padded to a cache line so they don't false share
+ */
+typedef struct {
+    long long count; /**< the net number of keys inserted through this stripe */
+    long long sum;   /**< the net sum of keys inserted through this stripe */
+} __attribute__((aligned(64))) hash_stripe_t;
+
+/**
+ * The hash functions a table can be created with
+ * Except HASH_FUNC_MOD, the bucket size is rounded up to a power of two,
+ * so selecting a bucket is a multiply or a few shifts plus a mask instead of a divide
+ */
+typedef enum {
+    HASH_FUNC_MOD = 0,   /**< key modulo bucket size, masked when the size is a power of two */
+    HASH_FUNC_FIBONACCI, /**< multiply by 2^32 / golden ratio and keep the top bits */
+    HASH_FUNC_MURMUR,    /**< the 32-bit finalizer of MurmurHash3 */
+    HASH_FUNC_XXHASH,    /**< xxHash32 of the 4-byte key with seed 0 */
+    HASH_FUNC_COUNT
+} hash_func_t;
 
 /**
  * The concurrent hash definition
- * The hash function is simply module bucket size (but effective)
+ * The hash function is selected when initialized, module bucket size by default
  * This implementation need no more parallel protection since list is already thread-safe
  * All operations except initialize and destroy are thread-safe
+ * Note that modifying hash->lists directly bypasses the stripes, so hash_size will not see it
  */
 typedef struct {
-    list_t *lists;   /**< lists for hash buckets */
-    int bucket_size; /**< the bucket size designated when initialized, can't be changed during use */
+    list_t *lists;           /**< lists for hash buckets */
+    int bucket_size;         /**< the bucket size designated when initialized, can't be changed during use */
+    hash_stripe_t *stripes;  /**< HASH_STRIPES deltas summed up by hash_size and hash_key_sum */
+    hash_func_t func;        /**< the hash function mapping keys to buckets */
+    unsigned int shift;      /**< 32 - log2(bucket_size), used by HASH_FUNC_FIBONACCI */
 } hash_t;
 
-void hash_init(hash_t *hash, int size);
+extern const char *hash_func_names[HASH_FUNC_COUNT];
+
+int hash_init(hash_t *hash, int size);
+int hash_init_func(hash_t *hash, int size, hash_func_t func);
 void hash_insert(hash_t *hash, unsigned int key);
-void hash_delete(hash_t *hash, unsigned int key);
+int hash_delete(hash_t *hash, unsigned int key);
+int hash_insert_unique(hash_t *hash, unsigned int key);
 void *hash_lookup(hash_t *hash, unsigned int key);
 void hash_destroy(hash_t *hash);
 
+void hash_insert_batch(hash_t *hash, const unsigned int *keys, int n);
+int hash_delete_batch(hash_t *hash, const unsigned int *keys, int n);
+void hash_lookup_batch(hash_t *hash, const unsigned int *keys, int n, void **results);
+
+long long hash_size(hash_t *hash);
+long long hash_key_sum(hash_t *hash);
+
+/**
+ * Whole-table operations below split the buckets across the given number of worker threads
+ * consistent = 1: all bucket locks are held during the scan, the result is a point-in-time view
+ * consistent = 0: each bucket is locked only while it is scanned, faster but may mix states,
+ *                 hash_count and hash_sum simply return the maintained hash_size and hash_key_sum
+ * A range whose worker thread can not be created is scanned by the caller, all of them return -1
+ * only if the scan itself can not be allocated
+ */
+int hash_count(hash_t *hash, int threads, int consistent);
+long long hash_sum(hash_t *hash, int threads, int consistent);
+int hash_for_each(hash_t *hash, int threads, int consistent, void (*fn)(unsigned int key, void *arg), void *arg);
+int hash_snapshot(hash_t *hash, int threads, int consistent, unsigned int **keys);
+
+#define HASH_HIST_SIZE 16
+
+/**
+ * A point-in-time report of how keys and operations are spread over the buckets
+ */
+typedef struct {
+    int bucket_size;                /**< the number of buckets */
+    long long keys;                 /**< the total number of keys */
+    double load_factor;             /**< keys per bucket */
+    double chain_stddev;            /**< the standard deviation of chain lengths */
+    int longest_chain;              /**< the length of the longest chain */
+    int longest_bucket;             /**< the bucket holding the longest chain */
+    int histogram[HASH_HIST_SIZE];  /**< histogram[i] buckets have i nodes, the last entry counts all longer chains */
+    unsigned long node_bytes;       /**< memory used by nodes, malloc overhead not included */
+    unsigned long bucket_bytes;     /**< memory used by the bucket array */
+    unsigned long lock_bytes;       /**< memory used by bucket locks, part of bucket_bytes */
+    unsigned long long ops;         /**< the total number of operations applied to buckets, 0 without LIST_STATS */
+    unsigned long *bucket_ops;      /**< operations applied to each bucket, freed by hash_stats_free */
+} hash_stats_t;
+
+void hash_stats(hash_t *hash, hash_stats_t *stats);
+void hash_stats_free(hash_stats_t *stats);
+
+#define HASH_IMAGE_MAGIC 0x53483450 /**< "P4HS" in little endian */
+#define HASH_IMAGE_VERSION 1
+
+/**
+ * The on-disk snapshot layout, all fields are in host byte order
+ * header | unsigned long long offsets[bucket_size + 1] | unsigned int keys[key_count]
+ * Keys of bucket i are keys[offsets[i] .. offsets[i + 1]), in insertion order
+ */
+typedef struct {
+    unsigned int magic;           /**< HASH_IMAGE_MAGIC */
+    unsigned int version;         /**< HASH_IMAGE_VERSION */
+    unsigned int bucket_size;     /**< the bucket size of the saved table */
+    unsigned int func;            /**< the hash_func_t of the saved table */
+    unsigned long long key_count; /**< the total number of keys */
+} hash_image_header_t;
+
+/**
+ * A snapshot file mapped read-only, can be queried in place without building a hash_t
+ */
+typedef struct {
+    void *base;                       /**< the start of the mapping */
+    unsigned long length;             /**< the length of the mapping */
+    const hash_image_header_t *header; /**< the header at the start of the file */
+    const unsigned long long *offsets; /**< the bucket offset table */
+    const unsigned int *keys;          /**< the packed key array */
+    unsigned int shift;                /**< 32 - log2(bucket_size), used by HASH_FUNC_FIBONACCI */
+} hash_image_t;
+
+int hash_save(hash_t *hash, const char *path);
+int hash_load(hash_t *hash, const char *path, int threads);
+int hash_image_open(hash_image_t *image, const char *path);
+const unsigned int *hash_image_lookup(hash_image_t *image, unsigned int key);
+void hash_image_close(hash_image_t *image);
+
 #endif //P4_HASH_H
@@ -0,0 +1,66 @@
+#include "latency.h"
+#include <string.h>
+
+/**
+ * Initialize an empty histogram
+ * @param latency A pointer to the histogram
+ */
+void latency_init(latency_t *latency) {
+    memset(latency, 0, sizeof(latency_t));
+}
+
+/**
+ * Add all samples of one histogram into another
+ * @param dst The histogram to be added to
+ * @param src The histogram to be added
+ */
+void latency_merge(latency_t *dst, const latency_t *src) {
+    int i;
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+/**
+ * Get the highest value that falls into the same bucket as the given index
+ */
+static unsigned long long latency_bucket_high(int index) {
+    if (index < (1 << LATENCY_SUB_BITS)) {
+        return (unsigned long long)index;
+    }
+    int shift = index / LATENCY_HALF - 1;
+    unsigned long long sub = (unsigned long long)(index - shift * LATENCY_HALF);
+    return ((sub + 1) << shift) - 1;
+}
+
+/**
+ * Get the value below which the given percentage of samples fall
+ * The result is the upper bound of the bucket, capped by the recorded maximum
+ * @param latency A pointer to the histogram
+ * @param percent The percentile, in [0, 100]
+ * @return The percentile value, 0 for an empty histogram
+ */
+unsigned long long latency_percentile(const latency_t *latency, double percent) {
+    int i;
+    unsigned long long seen = 0;
+    if (latency->total == 0) {
+        return 0;
+    }
+    unsigned long long rank = (unsigned long long)(percent / 100.0 * latency->total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += latency->counts[i];
+        if (seen >= rank) {
+            unsigned long long high = latency_bucket_high(i);
+            return high < latency->max ? high : latency->max;
+        }
+    }
+    return latency->max;
+}
@@ -0,0 +1,66 @@
+#ifndef P4_LATENCY_H
+#define P4_LATENCY_H
+
+#include <time.h>
+
+/**
+ * Log-linear bucketing in the style of HdrHistogram
+ * Values below 2^LATENCY_SUB_BITS get their own bucket, larger values are split into
+ * 2^(LATENCY_SUB_BITS - 1) buckets per power of two, so the relative error stays below 1 / 2^(LATENCY_SUB_BITS - 1)
+ */
+#define LATENCY_SUB_BITS 5
+#define LATENCY_HALF (1 << (LATENCY_SUB_BITS - 1))
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 2) * LATENCY_HALF)
+
+/**
+ * A latency histogram, meant to be owned by one thread and merged after the run
+ */
+typedef struct {
+    unsigned long long counts[LATENCY_BUCKETS]; /**< the number of samples in each bucket */
+    unsigned long long total;                   /**< the number of samples */
+    unsigned long long sum;                     /**< the sum of all samples */
+    unsigned long long max;                     /**< the largest sample */
+} latency_t;
+
+void latency_init(latency_t *latency);
+void latency_merge(latency_t *dst, const latency_t *src);
+unsigned long long latency_percentile(const latency_t *latency, double percent);
+
+/**
+ * Read the monotonic clock
+ * @return The current time in nanoseconds
+ */
+static inline unsigned long long latency_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+/**
+ * Map a value to its histogram bucket
+ * @param value The value to be recorded
+ * @return The bucket index
+ */
+static inline int latency_bucket(unsigned long long value) {
+    if (value < (1ULL << LATENCY_SUB_BITS)) {
+        return (int)value;
+    }
+    int shift = 63 - __builtin_clzll(value) - LATENCY_SUB_BITS + 1;
+    return shift * LATENCY_HALF + (int)(value >> shift);
+}
+
+/**
+ * Add one sample to the histogram, kept inline since it runs after every timed operation
+ * @param latency A pointer to the histogram
+ * @param value The sample, usually in nanoseconds
+ */
+static inline void latency_record(latency_t *latency, unsigned long long value) {
+    latency->counts[latency_bucket(value)]++;
+    latency->total++;
+    latency->sum += value;
+    if (value > latency->max) {
+        latency->max = value;
+    }
+}
+
+#endif //P4_LATENCY_H
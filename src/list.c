@@ -1,11 +1,40 @@
 #include "list.h"
 
+/**
+ * Update the maintained node count and key sum of the list
+ * Must be called with the list lock held, the stores are atomic so lock-free readers never see a torn value
+ * @param list A pointer to a list
+ * @param cnt The change of node count
+ * @param sum The change of key sum
+ */
+static inline void list_account(list_t *list, int cnt, long long sum) {
+    __atomic_store_n(&list->size, list->size + cnt, __ATOMIC_RELAXED);
+    __atomic_store_n(&list->total, list->total + sum, __ATOMIC_RELAXED);
+}
+
+/**
+ * Record n operations on the list for statistics, does nothing unless LIST_STATS is defined
+ * Lookups may run concurrently under a read lock, so the counter is always updated atomically
+ * @param list A pointer to a list
+ * @param n The number of operations
+ */
+static inline void list_touch(list_t *list, int n) {
+#if defined(LIST_STATS)
+    __atomic_fetch_add(&list->ops, n, __ATOMIC_RELAXED);
+#endif
+}
+
 /**
  * Initialize the given list
  * @param list A pointer to a list
  */
 void list_init(list_t *list) {
     list->head = NULL;
+    list->size = 0;
+    list->total = 0;
+#if defined(LIST_STATS)
+    list->ops = 0;
+#endif
     lock_init(&list->lock);
 }
 
@@ -24,39 +53,106 @@ void list_insert(list_t *list, unsigned int key) {
 #endif
     new_node->next = list->head;
     list->head = new_node;
+    list_account(list, 1, key);
+    list_touch(list, 1);
     lock_release(&list->lock);
 }
 
+/**
+ * Find the node with the given key and its predecessor, the caller must hold the lock
+ * @param list A pointer to a list
+ * @param key The key value to be searched
+ * @param pre Output of the predecessor of the found node, NULL if it is the head
+ * @return The node with the given key, NULL if the key is not found
+ */
+static inline node_t *list_find(list_t *list, unsigned int key, node_t **pre) {
+    node_t *cur = list->head;
+    *pre = NULL;
+    while (cur != NULL) {
+        if (cur->key == key) {
+            break;
+        }
+        *pre = cur;
+        cur = cur->next;
+    }
+    return cur;
+}
+
 /**
  * Delete one node with the given value
  * If multiple targets are found, only delete one of them
+ * With read-write locks the search runs under the upgradable read end, so a missing key never blocks readers
  * @param list A pointer to a list
  * @param key The key value of the node to be deleted
+ * @return 1 if a node is deleted, 0 if the key is not found
  */
-void list_delete(list_t* list, unsigned int key) {
+int list_delete(list_t* list, unsigned int key) {
+    node_t *pre;
 #if defined(LOCK_RWLOCK) || defined(LOCK_PRWLOCK)
-    rwlock_wrlock(&list->lock);
+    rwlock_uplock(&list->lock);
+    node_t *cur = list_find(list, key, &pre);
+    list_touch(list, 1);
+    if (cur == NULL) {
+        rwlock_upunlock(&list->lock);
+        return 0;
+    }
+    rwlock_upgrade(&list->lock);
 #else
     lock_acquire(&list->lock);
+    node_t *cur = list_find(list, key, &pre);
+    list_touch(list, 1);
+    if (cur == NULL) {
+        lock_release(&list->lock);
+        return 0;
+    }
 #endif
-    node_t* cur = list->head;
-    node_t* pre = NULL;
-    while (cur != NULL) {
-        if (cur->key == key) {
-            break;
-        }
-        pre = cur;
-        cur = cur->next;
+    if (pre != NULL) {
+        pre->next = cur->next;
+    } else { // cur is head
+        list->head = cur->next;
     }
-    if (cur != NULL) { // found target
-        if (pre != NULL) {
-            pre->next = cur->next;
-        } else { // cur is head
-            list->head = cur->next;
-        }
-        free(cur);
+    list_account(list, -1, -(long long)key);
+    lock_release(&list->lock);
+    free(cur);
+    return 1;
+}
+
+/**
+ * Insert a new node with value key at the head of the list, unless the key is already present
+ * With read-write locks the search runs under the upgradable read end and the node is allocated before upgrading,
+ * so readers are only blocked while the node is linked
+ * @param list A pointer to a list
+ * @param key The value to be inserted
+ * @return 1 if the key is inserted, 0 if it is already present
+ */
+int list_insert_unique(list_t *list, unsigned int key) {
+    node_t *pre;
+#if defined(LOCK_RWLOCK) || defined(LOCK_PRWLOCK)
+    rwlock_uplock(&list->lock);
+    list_touch(list, 1);
+    if (list_find(list, key, &pre) != NULL) {
+        rwlock_upunlock(&list->lock);
+        return 0;
     }
+    node_t *new_node = malloc(sizeof(node_t));
+    new_node->key = key;
+    rwlock_upgrade(&list->lock);
+#else
+    node_t *new_node = malloc(sizeof(node_t));
+    new_node->key = key;
+    lock_acquire(&list->lock);
+    list_touch(list, 1);
+    if (list_find(list, key, &pre) != NULL) {
+        lock_release(&list->lock);
+        free(new_node);
+        return 0;
+    }
+#endif
+    new_node->next = list->head;
+    list->head = new_node;
+    list_account(list, 1, key);
     lock_release(&list->lock);
+    return 1;
 }
 
 /**
@@ -81,50 +177,160 @@ void* list_lookup(list_t* list, unsigned int key) {
         }
         cur = cur->next;
     }
+    list_touch(list, 1);
     lock_release(&list->lock);
     return cur;
 }
 
 /**
- * Calculate the total number of nodes in this list
+ * Insert a batch of keys within a single critical section
+ * The nodes are allocated and chained outside the lock, then the whole chain is spliced at the head,
+ * so the resulting list is the same as inserting the keys one by one in the given order
  * @param list A pointer to a list
- * @return The total number of nodes in the list
+ * @param keys The values to be inserted
+ * @param n The number of keys
  */
-int list_count(list_t* list) {
+void list_insert_batch(list_t *list, const unsigned int *keys, int n) {
+    int i;
+    long long sum = 0;
+    node_t *first = NULL;
+    node_t *last = NULL;
+    if (n <= 0) {
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        node_t *new_node = malloc(sizeof(node_t));
+        new_node->key = keys[i];
+        new_node->next = first;
+        first = new_node;
+        sum += keys[i];
+        if (last == NULL) {
+            last = new_node;
+        }
+    }
 #if defined(LOCK_RWLOCK) || defined(LOCK_PRWLOCK)
-    rwlock_rdlock(&list->lock);
+    rwlock_wrlock(&list->lock);
 #else
     lock_acquire(&list->lock);
 #endif
-    int cnt = 0;
-    node_t *cur = list->head;
-    while (cur != NULL) {
-        cnt++;
-        cur = cur->next;
+    last->next = list->head;
+    list->head = first;
+    list_account(list, n, sum);
+    list_touch(list, n);
+    lock_release(&list->lock);
+}
+
+/**
+ * Delete one node for each of the given keys within a single critical section
+ * With read-write locks the search runs under the upgradable read end until the first key is found
+ * Unlinked nodes are freed after the lock is released
+ * @param list A pointer to a list
+ * @param keys The key values of the nodes to be deleted
+ * @param n The number of keys
+ * @param removed_sum Output of the sum of deleted keys, may be NULL
+ * @return The number of nodes actually deleted
+ */
+int list_delete_batch(list_t *list, const unsigned int *keys, int n, long long *removed_sum) {
+    int i, cnt = 0;
+    long long sum = 0;
+    node_t *garbage = NULL;
+#if defined(LOCK_RWLOCK) || defined(LOCK_PRWLOCK)
+    int upgraded = 0;
+    rwlock_uplock(&list->lock);
+#else
+    lock_acquire(&list->lock);
+#endif
+    for (i = 0; i < n; i++) {
+        node_t *pre;
+        node_t *cur = list_find(list, keys[i], &pre);
+        if (cur != NULL) { // found target
+#if defined(LOCK_RWLOCK) || defined(LOCK_PRWLOCK)
+            if (!upgraded) { // block readers only from the first actual deletion on
+                rwlock_upgrade(&list->lock);
+                upgraded = 1;
+            }
+#endif
+            if (pre != NULL) {
+                pre->next = cur->next;
+            } else { // cur is head
+                list->head = cur->next;
+            }
+            cur->next = garbage;
+            garbage = cur;
+            cnt++;
+            sum += keys[i];
+        }
+    }
+    list_account(list, -cnt, -sum);
+    list_touch(list, n);
+#if defined(LOCK_RWLOCK) || defined(LOCK_PRWLOCK)
+    if (!upgraded) {
+        rwlock_upunlock(&list->lock);
+    } else {
+        lock_release(&list->lock);
     }
+#else
     lock_release(&list->lock);
+#endif
+
+    if (removed_sum != NULL) {
+        *removed_sum = sum;
+    }
+    while (garbage != NULL) {
+        node_t *next = garbage->next;
+        free(garbage);
+        garbage = next;
+    }
     return cnt;
 }
 
 /**
- * Calculate the sum of all nodes' key field
+ * Look up a batch of keys within a single critical section
+ * results[i] is set to the node holding keys[i], or NULL if there is none
  * @param list A pointer to a list
- * @return The sum of all nodes' value
+ * @param keys The key values to be looked up
+ * @param n The number of keys
+ * @param results Output array of at least n node pointers
  */
-long long list_sum(list_t* list) {
+void list_lookup_batch(list_t *list, const unsigned int *keys, int n, void **results) {
+    int i;
 #if defined(LOCK_RWLOCK) || defined(LOCK_PRWLOCK)
     rwlock_rdlock(&list->lock);
 #else
     lock_acquire(&list->lock);
 #endif
-    long long res = 0;
-    node_t *cur = list->head;
-    while (cur != NULL) {
-        res += cur->key;
-        cur = cur->next;
+    for (i = 0; i < n; i++) {
+        node_t* cur = list->head;
+        while (cur != NULL) {
+            if (cur->key == keys[i]) {
+                break;
+            }
+            cur = cur->next;
+        }
+        results[i] = cur;
     }
+    list_touch(list, n);
     lock_release(&list->lock);
-    return res;
+}
+
+/**
+ * Get the total number of nodes in this list
+ * The count is maintained by writers, so this is O(1) and does not take the lock
+ * @param list A pointer to a list
+ * @return The total number of nodes in the list
+ */
+int list_count(list_t* list) {
+    return __atomic_load_n(&list->size, __ATOMIC_RELAXED);
+}
+
+/**
+ * Get the sum of all nodes' key field
+ * The sum is maintained by writers, so this is O(1) and does not take the lock
+ * @param list A pointer to a list
+ * @return The sum of all nodes' value
+ */
+long long list_sum(list_t* list) {
+    return __atomic_load_n(&list->total, __ATOMIC_RELAXED);
 }
 
 /**
@@ -144,5 +350,8 @@ void list_destroy(list_t* list) {
         cur = cur->next;
         free(pre);
     }
+    list->head = NULL;
+    list->size = 0;
+    list->total = 0;
     lock_release(&list->lock);
 }
\ No newline at end of file
@@ -5,6 +5,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+/**
+ * Uncomment to count the operations applied to every list, reported per bucket by hash_stats
+ * Every operation, lookups under a read lock included, then adds to a counter in the list,
+ * a contended read-modify-write on the bucket line, so the counter is off by default
+ */
+//#define LIST_STATS
+
 /**
  * Node type in the list
  *
@@ -19,18 +26,30 @@ typedef struct _node_t {
  * A concurrent list definition
  * All operations except initialization and destroy are thread-safe
  * Maintain a head-insert linked-list
+ * The node count and key sum are kept up to date by writers, so they can be read without the lock
  */
 typedef struct {
-    node_t *head; /**< a pointer to the head node */
-    lock_t lock;  /**< guarantee sequential execution in list functions */
+    node_t *head;      /**< a pointer to the head node */
+    long long total;   /**< the sum of all keys, only written under the lock */
+#if defined(LIST_STATS)
+    unsigned long ops; /**< the number of insert/delete/lookup operations applied */
+#endif
+    int size;          /**< the number of nodes, only written under the lock */
+    lock_t lock;       /**< guarantee sequential execution in list functions, last so a lock of up to 4 bytes
+                            takes the padding after size and a bucket is 24 bytes */
 } list_t;
 
 void list_init(list_t *list);
 void list_insert(list_t *list, unsigned int key);
-void list_delete(list_t *list, unsigned int key);
+int list_delete(list_t *list, unsigned int key);
+int list_insert_unique(list_t *list, unsigned int key);
 void *list_lookup(list_t *list, unsigned int key);
 void list_destroy(list_t* list);
 
+void list_insert_batch(list_t *list, const unsigned int *keys, int n);
+int list_delete_batch(list_t *list, const unsigned int *keys, int n, long long *removed_sum);
+void list_lookup_batch(list_t *list, const unsigned int *keys, int n, void **results);
+
 int list_count(list_t* list);
 long long list_sum(list_t* list);
 
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include "lock.h"
 #include <sys/syscall.h>
@@ -5,6 +6,7 @@
 #include <stdio.h>
 #include <time.h>
 #include <unistd.h>
+#include <sched.h>
 
 // struct timespec wait_time = { 1, 0 };
 
@@ -27,77 +29,114 @@ static long sys_futex(void *addr1, int op, int val1, struct timespec *timeout, v
 }
 
 /**
- * Pause the cpu core using assembly code to avoid bad performance on some machine
+ * Sleep on the futex word addr as long as it still holds val
+ * Spurious wake-ups are possible, so the caller must recheck its condition
+ * @param addr A pointer to a futex word
+ * @param val The value the caller last saw in addr
+ * @return 0 if woken up, -1 if addr no longer held val or the wait was interrupted
  */
-static inline void cpu_pause(void) {
-    //asm volatile("rep; nop" : : : "memory");
-    asm volatile("pause\n": : :"memory");
+int futex_wait(unsigned *addr, unsigned val) {
+    return sys_futex(addr, FUTEX_WAIT_PRIVATE, (int)val, NULL, NULL, 0) == 0 ? 0 : -1;
 }
 
 /**
- * Calling embedded assembly instruction "xchg"
- * This instruction completes atomic operation of
- * exchanging values from the pointer addr to the newval
- * @param addr A pointer to the mutex value
- * @param newval The new value to be swapped
- * @return The previous value of the pointer addr referenced
+ * Sleep on the futex word addr as long as it still holds val, at most for the given time
+ * @param addr A pointer to a futex word
+ * @param val The value the caller last saw in addr
+ * @param timeout_ns The longest time to sleep, in ns
+ * @return 0 if woken up, -1 if addr no longer held val, the wait was interrupted or timed out
  */
-static inline unsigned xchg(void *addr, unsigned newval) {
-    asm volatile("xchgl %0, %1"
-    : "=r" (newval)
-    :"m" (*(volatile unsigned *)addr), "0" (newval)
-    :"memory");
-    return newval;
+int futex_wait_timed(unsigned *addr, unsigned val, long long timeout_ns) {
+    struct timespec timeout = {timeout_ns / 1000000000, timeout_ns % 1000000000};
+    return sys_futex(addr, FUTEX_WAIT_PRIVATE, (int)val, &timeout, NULL, 0) == 0 ? 0 : -1;
 }
 
 /**
- * Calling embedded assembly instruction "cmpxchg"
- * This instruction completes atomic operation of
- * comparing the value of the pointer addr pointed with oldval,
- * if equal, put newval into the position of the addr pointer and return to oldval
- * return to the value pointed by addr instead
- * @param addr A pointer to the mutex value
- * @param oldval A value to be compared
- * @param newval A value to write into addr
- * @return oldval or *addr
+ * Wake up threads sleeping on the futex word addr
+ * @param addr A pointer to a futex word
+ * @param count The maximum number of threads to wake up
+ * @return The number of threads woken up
  */
-static inline uint cmpxchg(void *addr, unsigned int oldval, unsigned int newval) {
-    uint ret;
-    asm volatile("lock; cmpxchgl %1, %2"
-    : "=a" (ret)
-    : "r" (newval), "m" (*(volatile unsigned *)addr), "0" (oldval)
-    : "memory");
-    return ret;
+int futex_wake(unsigned *addr, int count) {
+    return (int)sys_futex(addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
 }
 
+#if defined(LOCK_PREEMPT_AWARE)
+lock_owner_t lock_owners[1 << LOCK_OWNER_BITS];
+
 /**
- * Initialize a spin-lock, should be called before use
- * @param lock Pointer to the spin-lock need to be initialized
+ * Pauses a waiter spends on a lock before it gives up, even if the holder runs on another CPU
+ * A holder that keeps the lock this long was most likely descheduled inside its critical section
  */
-void spinlock_init(spinlock_t* lock) {
-    *lock = 0;
+#define LOCK_SPIN_BUDGET 4096
+
+/**
+ * The waiter looks at the published holder once every LOCK_PROBE_MASK + 1 pauses
+ */
+#define LOCK_PROBE_MASK 63
+
+/**
+ * Publish the calling thread as the holder of lock, called after every successful acquire
+ * The slot is only written when the CPU changed, so a lock taken on one CPU keeps its slot cached
+ * @param lock The lock just acquired
+ */
+void lock_owner_publish(const void *lock) {
+    lock_owner_t *owner = lock_owner(lock);
+    int cpu = sched_getcpu();
+    if (__atomic_load_n(&owner->cpu, __ATOMIC_RELAXED) != cpu) {
+        __atomic_store_n(&owner->cpu, cpu, __ATOMIC_RELAXED);
+    }
 }
 
 /**
- * Try to acquire the given spin-lock
- * If the lock currently not available, this function will keep trying until somebody release the lock
- * @param lock Pointer to the spin-lock want to obtain
+ * Decide whether a waiter should stop spinning on lock
+ * Spinning only pays off while the holder runs on another CPU and is about to release
+ * @param lock The lock the caller waits for
+ * @param spins The pauses the caller spent on the lock so far
+ * @return 1 if the holder shares the CPU of the caller or the spin budget ran out
  */
-void spinlock_acquire(spinlock_t *lock) {
-    while (xchg(lock, 1) == 1) {
-        cpu_pause(); // spin-wait
+static int lock_owner_stalled(const void *lock, int spins) {
+    if (spins >= LOCK_SPIN_BUDGET) {
+        return 1;
+    }
+    if (spins & LOCK_PROBE_MASK) {
+        return 0;
     }
+    return __atomic_load_n(&lock_owner(lock)->cpu, __ATOMIC_RELAXED) == sched_getcpu();
 }
+#endif
 
 /**
- * Release the given spin-lock
- * Notice that release a lock not hold by itself will cause unpredictable result
- * @param lock Pointer to the spin-lock want to release
+ * Initialize a spin-lock, should be called before use
+ * @param lock Pointer to the spin-lock need to be initialized
  */
-void spinlock_release(spinlock_t *lock) {
+void spinlock_init(spinlock_t* lock) {
     *lock = 0;
 }
 
+/**
+ * Slow path of spinlock_acquire, entered after the inline attempt failed
+ * Keep trying until somebody release the lock, only reading the lock word while it is held
+ * @param lock Pointer to the spin-lock want to obtain
+ */
+void spinlock_acquire_slow(spinlock_t *lock) {
+#if defined(LOCK_PREEMPT_AWARE)
+    int spins = 0;
+#endif
+    do {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+#if defined(LOCK_PREEMPT_AWARE)
+            if (lock_owner_stalled(lock, spins++)) {
+                sched_yield(); // give the time slice to the holder instead of burning it
+                spins = 0;
+                continue;
+            }
+#endif
+            cpu_pause(); // spin-wait
+        }
+    } while (xchg(lock, 1) == 1);
+}
+
 /**
  * Initialize a mutex, should be called before use
  * @param lock Pointer to the mutex need to be initialized
@@ -107,12 +146,12 @@ void mutex_init(mutex_t *lock) {
 }
 
 /**
- * Try to acquire the given mutex
- * A failed try will cause the thread sleep until another thread wake it by releasing this mutex
+ * Slow path of mutex_acquire, entered after the inline attempt failed
+ * The thread sleeps until another thread wake it by releasing this mutex
  * @param lock Pointer to the mutex want to obtain
  */
-void mutex_acquire(mutex_t *lock) {
-    int value = xchg(lock, 1);
+void mutex_acquire_slow(mutex_t *lock) {
+    int value = 1;
     while (value) {
         sys_futex(lock, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
         value = xchg(lock, 1);
@@ -138,7 +177,7 @@ void twophase_init(twophase_t *lock) {
 }
 
 /**
- * Acquire the given two-phase in two phases
+ * Slow path of twophase_acquire, entered after the inline cmpxchg failed
  * Wait for some one to release first, the wait time is designated by the LOOP_MAX macro (defined below)
  * If the lock still acquired by someone else after wait phase, it will sleep until someone release the lock
  * lock = 0 means unlock state;
@@ -147,13 +186,18 @@ void twophase_init(twophase_t *lock) {
  * @param lock Pointer to the two-phase lock want to obtain
  */
 #define LOOP_MAX 100000
-void twophase_acquire(twophase_t *lock) {
+void twophase_acquire_slow(twophase_t *lock) {
     int i, value = 1;
     for (i = 0; i < LOOP_MAX; i++) {
         value = cmpxchg(lock, 0, 1);
         if (value == 0) {
             return;
         }
+#if defined(LOCK_PREEMPT_AWARE)
+        if (lock_owner_stalled(lock, i)) {
+            break; // the holder is not running, sleep right away
+        }
+#endif
         cpu_pause();
     }
 
@@ -167,21 +211,20 @@ void twophase_acquire(twophase_t *lock) {
 }
 
 /**
- * Release the given two-phase lock in two phases
+ * Slow path of twophase_release, entered when the lock was marked as having sleepers
+ * The lock word has already been cleared by the inline release
  * In the first phase it will try to give the lock to someone awake
  * If failed, it will wake up a sleeping thread on this lock
  * @param lock Pointer to the two-phase lock want to release
  */
-void twophase_release(twophase_t *lock) {
+void twophase_release_slow(twophase_t *lock) {
     int i;
 
-    if (*lock == 2) {
-        *lock = 0;
-    } else if (xchg(lock, 0) == 1) {
-        return;
-    }
-
+#if defined(LOCK_PREEMPT_AWARE)
+    for (i = 0; i < LOCK_SPIN_BUDGET; i++) { // a waiter that stopped spinning sleeps, do not wait long for one
+#else
     for (i = 0; i < LOOP_MAX; i++) {
+#endif
         if (*lock) {
             if (cmpxchg(lock, 1, 2)) {
                 return;
@@ -217,7 +260,7 @@ void cond_wait(cond_t* cv, twophase_t* mutex) {
             perror("cond mutex already exists!");
             return;
         }
-        cmpxchg(&cv->mutex, (unsigned)(unsigned long)NULL, (unsigned)(unsigned long)mutex);
+        __sync_bool_compare_and_swap(&cv->mutex, NULL, mutex);
         if (cv->mutex != mutex) {
             perror("cond mutex incompatible!");
             return;
@@ -257,6 +300,182 @@ void cond_broadcast(cond_t* cv) {
     sys_futex(&cv->seq, FUTEX_REQUEUE_PRIVATE, 1, (void*) 0x0FFFFFFF, old_mutex, 0);	// *((int*) 0x0FFFFFFF)
 }
 
+/**
+ * Initialize a barrier, should be called before use
+ * @param barrier Pointer to the barrier need to be initialized
+ * @param count The number of threads taking part in every phase
+ */
+void barrier_init(barrier_t *barrier, unsigned count) {
+    barrier->count = count;
+    barrier->arrived = 0;
+    barrier->phase = 0;
+    barrier->waiters = 0;
+}
+
+/**
+ * Wait until all threads of the current phase arrived at the barrier
+ * The last thread to arrive flips the phase, the others spin for LOOP_MAX rounds like a two-phase lock,
+ * then sleep on the phase word; the flip only makes a syscall if somebody sleeps
+ * @param barrier Pointer to the barrier
+ * @return 1 for the last thread to arrive, 0 for the others
+ */
+int barrier_wait(barrier_t *barrier) {
+    return barrier_wait_last(barrier, NULL, NULL);
+}
+
+/**
+ * Wait until all threads of the current phase arrived at the barrier, the last one runs a hook first
+ * The hook runs before the phase flips, so it happens before any thread of the phase is released
+ * @param barrier Pointer to the barrier
+ * @param last Called by the last thread to arrive before it releases the others, may be NULL
+ * @param arg The argument passed to last
+ * @return 1 for the last thread to arrive, 0 for the others
+ */
+int barrier_wait_last(barrier_t *barrier, void (*last)(void *arg), void *arg) {
+    int i;
+    unsigned phase = __atomic_load_n(&barrier->phase, __ATOMIC_ACQUIRE);
+    if (__atomic_add_fetch(&barrier->arrived, 1, __ATOMIC_ACQ_REL) == barrier->count) {
+        if (last != NULL) {
+            last(arg);
+        }
+        __atomic_store_n(&barrier->arrived, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&barrier->phase, phase + 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&barrier->waiters, __ATOMIC_SEQ_CST)) {
+            sys_futex(&barrier->phase, FUTEX_WAKE_PRIVATE, 0x7FFFFFFF, NULL, NULL, 0);
+        }
+        return 1;
+    }
+    for (i = 0; i < LOOP_MAX; i++) {
+        if (__atomic_load_n(&barrier->phase, __ATOMIC_ACQUIRE) != phase) {
+            return 0;
+        }
+        cpu_pause();
+    }
+    __atomic_fetch_add(&barrier->waiters, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&barrier->phase, __ATOMIC_ACQUIRE) == phase) {
+        sys_futex(&barrier->phase, FUTEX_WAIT_PRIVATE, (int)phase, NULL, NULL, 0);
+    }
+    __atomic_fetch_sub(&barrier->waiters, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * Initialize a semaphore, should be called before use
+ * @param sem Pointer to the semaphore need to be initialized
+ * @param value The number of units initially available
+ */
+void semaphore_init(semaphore_t *sem, unsigned value) {
+    sem->value = value;
+    sem->waiters = 0;
+}
+
+/**
+ * Take one unit of the semaphore if one is available, without blocking
+ * @param sem Pointer to the semaphore
+ * @return 1 if a unit is taken, 0 if none is available
+ */
+int semaphore_trywait(semaphore_t *sem) {
+    unsigned value = __atomic_load_n(&sem->value, __ATOMIC_RELAXED);
+    while (value > 0) {
+        if (__atomic_compare_exchange_n(&sem->value, &value, value - 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Take one unit of the semaphore, waiting until one is available
+ * Spin for LOOP_MAX rounds like a two-phase lock, then sleep until semaphore_post
+ * @param sem Pointer to the semaphore
+ */
+void semaphore_wait(semaphore_t *sem) {
+    int i;
+    for (i = 0; i < LOOP_MAX; i++) {
+        if (semaphore_trywait(sem)) {
+            return;
+        }
+        cpu_pause();
+    }
+    __atomic_fetch_add(&sem->waiters, 1, __ATOMIC_SEQ_CST);
+    while (!semaphore_trywait(sem)) {
+        sys_futex(&sem->value, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+    }
+    __atomic_fetch_sub(&sem->waiters, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Return one unit to the semaphore and wake up a sleeping waiter, if there is any
+ * @param sem Pointer to the semaphore
+ */
+void semaphore_post(semaphore_t *sem) {
+    __atomic_fetch_add(&sem->value, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sem->waiters, __ATOMIC_SEQ_CST)) {
+        sys_futex(&sem->value, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/**
+ * Initialize an event in the reset state, should be called before use
+ * @param event Pointer to the event need to be initialized
+ * @param autoreset 1 for an auto-reset event, 0 for a manual-reset one
+ */
+void event_init(event_t *event, int autoreset) {
+    event->state = 0;
+    event->waiters = 0;
+    event->autoreset = autoreset != 0;
+}
+
+/**
+ * Consume the event if it is set, auto-reset events are reset by the caller that gets through
+ */
+static inline int event_try(event_t *event) {
+    if (!event->autoreset) {
+        return __atomic_load_n(&event->state, __ATOMIC_ACQUIRE) == 1;
+    }
+    return cmpxchg(&event->state, 1, 0) == 1;
+}
+
+/**
+ * Set the event
+ * A manual-reset event releases all waiters, an auto-reset event releases one of them
+ * @param event Pointer to the event
+ */
+void event_set(event_t *event) {
+    xchg(&event->state, 1);
+    if (__atomic_load_n(&event->waiters, __ATOMIC_SEQ_CST)) {
+        sys_futex(&event->state, FUTEX_WAKE_PRIVATE, event->autoreset ? 1 : 0x7FFFFFFF, NULL, NULL, 0);
+    }
+}
+
+/**
+ * Reset the event, so later waiters block until the next event_set
+ * @param event Pointer to the event
+ */
+void event_reset(event_t *event) {
+    __atomic_store_n(&event->state, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Wait until the event is set
+ * Spin for LOOP_MAX rounds like a two-phase lock, then sleep until event_set
+ * @param event Pointer to the event
+ */
+void event_wait(event_t *event) {
+    int i;
+    for (i = 0; i < LOOP_MAX; i++) {
+        if (event_try(event)) {
+            return;
+        }
+        cpu_pause();
+    }
+    __atomic_fetch_add(&event->waiters, 1, __ATOMIC_SEQ_CST);
+    while (!event_try(event)) {
+        sys_futex(&event->state, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+    }
+    __atomic_fetch_sub(&event->waiters, 1, __ATOMIC_RELAXED);
+}
+
 /**
  * Initialize a read-write lock, should be called before use
  * @param lock Pointer to the read-write lock need to be initialized
@@ -267,18 +486,23 @@ void rwlock_init(rwlock_t* lock) {
 #else //if defined(LOCK_RWLOCK)
     lock->readers = 0;
     lock->writers = 0;
+    lock->upgraders = 0;
+    lock->upgrading = 0;
     lock->read_waiters = 0;
     lock->write_waiters = 0;
+    lock->up_waiters = 0;
     twophase_init(&lock->mutex);
     cond_init(&lock->reader_lock);
     cond_init(&lock->writer_lock);
+    cond_init(&lock->upgrader_lock);
+    cond_init(&lock->drain_lock);
 #endif
 }
 
 /**
  * Acquire the read-end of the given read-write lock
- * The calling thread acquires the read lock if no writer hold the lock
- * and there are no writers in blocked on the lock.
+ * The calling thread acquires the read lock if no writer hold the lock,
+ * there are no writers in blocked on the lock and the upgrader is not waiting to upgrade.
  * @param lock Pointer to the read-write lock to be acquired
  */
 void rwlock_rdlock(rwlock_t *lock) {
@@ -286,7 +510,7 @@ void rwlock_rdlock(rwlock_t *lock) {
     pthread_rwlock_rdlock(lock);
 #else //if defined(LOCK_RWLOCK)
     twophase_acquire(&lock->mutex);
-    while (lock->writers || lock->write_waiters) {
+    while (lock->writers || lock->write_waiters || lock->upgrading) {
         lock->read_waiters++;
         cond_wait(&lock->reader_lock, &lock->mutex);
         lock->read_waiters--;
@@ -298,7 +522,7 @@ void rwlock_rdlock(rwlock_t *lock) {
 
 /**
  * Acquire the write-end of the given read-write lock
- * The calling thread acquires the write lock if no other thread holds the rwlock
+ * The calling thread acquires the write lock if no other thread holds the rwlock (including the upgradable end)
  * Otherwise, the thread shall block until it can acquire the rwlock
  * @param lock Pointer to the read-write lock to be acquired
  */
@@ -307,7 +531,7 @@ void rwlock_wrlock(rwlock_t *lock) {
     pthread_rwlock_wrlock(lock);
 #else //if defined(LOCK_RWLOCK)
     twophase_acquire(&lock->mutex);
-    while (lock->readers || lock->writers) {
+    while (lock->readers || lock->writers || lock->upgraders) {
         lock->write_waiters++;
         cond_wait(&lock->writer_lock, &lock->mutex);
         lock->write_waiters--;
@@ -320,12 +544,15 @@ void rwlock_wrlock(rwlock_t *lock) {
 /**
  * Release the read-write lock, for both read and write end according to POSIX standard
  * If this function is called by a read lock:
- * firstly, if there are other writers blocked currently, one write thread(s) shall acquire the lock.
+ * firstly, if the upgrader waits for the last reader to leave, it shall acquire the write end.
+ * secondly, if there are other writers blocked currently, one write thread(s) shall acquire the lock.
  * otherwise, the rwlock shall turn into unlocked state.
  * If this function is called by a write lock:
  * firstly, if there are other writers blocked currently, one write thread shall acquire the lock.
  * secondly, if there are other readers blocked currently, all of the reader threads shall be awakened.
+ * A thread waiting for the upgradable end is awakened in both cases, as it can run alongside readers.
  * Note this implement slightly favour the writers
+ * The upgradable end is released by rwlock_upunlock instead, unless it has been upgraded
  * @param lock Pointer to the read-write to be released
  */
 void rwlock_unlock(rwlock_t* lock) {
@@ -335,7 +562,9 @@ void rwlock_unlock(rwlock_t* lock) {
     twophase_acquire(&lock->mutex);
     if (lock->readers) {
         lock->readers--;
-        if (lock->write_waiters) {
+        if (lock->readers == 0 && lock->upgrading) {
+            cond_signal(&lock->drain_lock);
+        } else if (lock->write_waiters && !lock->upgraders) {
             cond_signal(&lock->writer_lock);
         }
         // reader thread must be awakened by writer thread?
@@ -346,61 +575,95 @@ void rwlock_unlock(rwlock_t* lock) {
         } else if (lock->read_waiters) {
             cond_broadcast(&lock->reader_lock);
         }
+        if (lock->up_waiters) {
+            cond_signal(&lock->upgrader_lock);
+        }
     }
     twophase_release(&lock->mutex);
 #endif
 }
 
 /**
- * The generic lock initialization method, not use macro for the debug consideration
- * The lock type is designated by the macros defined in header file
- * @param lock A pointer to the lock to be initialized
+ * Acquire the upgradable read-end of the given read-write lock
+ * The calling thread shares the lock with readers, but no writer or other upgrader can hold it at the same time,
+ * so what it reads stays valid when it later upgrades
+ * Under LOCK_PRWLOCK there is no upgradable end, the write end is taken instead
+ * @param lock Pointer to the read-write lock to be acquired
  */
-void lock_init(lock_t* lock) {
-#if defined(LOCK_MUTEX)
-    mutex_init(lock);
-#elif defined(LOCK_SPIN)
-    spinlock_init(lock);
-#elif defined(LOCK_TWOPHASE)
-    twophase_init(lock);
-#elif defined(LOCK_PTHREAD)
-    pthread_mutex_init(lock, NULL);
-#elif defined(LOCK_RWLOCK) || defined(LOCK_PRWLOCK)
-    rwlock_init(lock);
+void rwlock_uplock(rwlock_t *lock) {
+#if defined(LOCK_PRWLOCK)
+    pthread_rwlock_wrlock(lock);
+#else //if defined(LOCK_RWLOCK)
+    twophase_acquire(&lock->mutex);
+    while (lock->writers || lock->write_waiters || lock->upgraders) {
+        lock->up_waiters++;
+        cond_wait(&lock->upgrader_lock, &lock->mutex);
+        lock->up_waiters--;
+    }
+    lock->upgraders = 1;
+    twophase_release(&lock->mutex);
 #endif
 }
 
 /**
- * The generic lock acquire method
- * Note that read-write locks DO NOT call this function
- * @param lock A pointer to the lock to be acquired
+ * Release the upgradable read-end of the given read-write lock without having upgraded it
+ * A blocked writer acquires the lock if no reader is left, otherwise the next upgrader is awakened
+ * @param lock Pointer to the read-write lock to be released
  */
-void lock_acquire(lock_t* lock) {
-#if defined(LOCK_MUTEX)
-    mutex_acquire(lock);
-#elif defined(LOCK_SPIN)
-    spinlock_acquire(lock);
-#elif defined(LOCK_TWOPHASE)
-    twophase_acquire(lock);
-#elif defined(LOCK_PTHREAD)
-    pthread_mutex_lock(lock);
+void rwlock_upunlock(rwlock_t *lock) {
+#if defined(LOCK_PRWLOCK)
+    pthread_rwlock_unlock(lock);
+#else //if defined(LOCK_RWLOCK)
+    twophase_acquire(&lock->mutex);
+    lock->upgraders = 0;
+    if (lock->write_waiters) {
+        if (lock->readers == 0) {
+            cond_signal(&lock->writer_lock);
+        }
+    } else if (lock->up_waiters) {
+        cond_signal(&lock->upgrader_lock);
+    }
+    twophase_release(&lock->mutex);
 #endif
 }
 
 /**
- * The generic lock release method
- * @param lock A pointer to the lock to be released
+ * Turn the upgradable read-end held by the caller into the write end, without releasing the lock in between
+ * New readers are held back while the current ones leave, then the caller becomes the writer
+ * Under LOCK_PRWLOCK the caller already holds the write end, so nothing is done
+ * @param lock Pointer to the read-write lock to be upgraded
  */
-void lock_release(lock_t* lock) {
-#if defined(LOCK_MUTEX)
-    mutex_release(lock);
-#elif defined(LOCK_SPIN)
-    spinlock_release(lock);
-#elif defined(LOCK_TWOPHASE)
-    twophase_release(lock);
-#elif defined(LOCK_PTHREAD)
-    pthread_mutex_unlock(lock);
-#elif defined(LOCK_RWLOCK) || defined(LOCK_PRWLOCK)
-    rwlock_unlock(lock);
+void rwlock_upgrade(rwlock_t *lock) {
+#if !defined(LOCK_PRWLOCK)
+    twophase_acquire(&lock->mutex);
+    lock->upgrading = 1;
+    while (lock->readers) {
+        cond_wait(&lock->drain_lock, &lock->mutex);
+    }
+    lock->upgrading = 0;
+    lock->upgraders = 0;
+    lock->writers = 1;
+    twophase_release(&lock->mutex);
+#endif
+}
+
+/**
+ * Turn the write end held by the caller into a read-end, without releasing the lock in between
+ * Blocked readers are let in, blocked writers keep waiting until the caller calls rwlock_unlock
+ * Under LOCK_PRWLOCK the caller keeps the write end, which still excludes every writer
+ * @param lock Pointer to the read-write lock to be downgraded
+ */
+void rwlock_downgrade(rwlock_t *lock) {
+#if !defined(LOCK_PRWLOCK)
+    twophase_acquire(&lock->mutex);
+    lock->writers = 0;
+    lock->readers++;
+    if (lock->read_waiters && !lock->write_waiters) {
+        cond_broadcast(&lock->reader_lock);
+    }
+    if (lock->up_waiters && !lock->write_waiters) {
+        cond_signal(&lock->upgrader_lock);
+    }
+    twophase_release(&lock->mutex);
 #endif
 }
@@ -2,12 +2,14 @@
 #define P4_LOCK_H
 
 #include <pthread.h>
+#include "parking.h"
 
 /**
- * The following 6 lock types are exclusive
+ * The following 7 lock types are exclusive
  * Select one of them and comment others to enable specific implementation for generic lock
  * Note that rwlock will not implement lock_acquire, but rewrite implements of counter and list instead
  * Also note that pthread rwlock rewrite rwlock implement
+ * The parking lock is a single byte, its waiters sleep in the global table of parking.c
  */
 //#define LOCK_SPIN
 //#define LOCK_MUTEX
@@ -15,6 +17,15 @@
 //#define LOCK_RWLOCK
 //#define LOCK_PTHREAD
 //#define LOCK_PRWLOCK
+//#define LOCK_PARKING
+
+/**
+ * Independent of the choice above, make spin-locks and two-phase locks tolerate a preempted holder
+ * Every acquire publishes the CPU it took the lock on, a waiter stops spinning when the holder sits on the waiter's
+ * own CPU, so it cannot be running, or when the spin budget ran out because the holder was descheduled elsewhere:
+ * spin-lock waiters then yield the CPU and two-phase waiters go to sleep at once
+ */
+//#define LOCK_PREEMPT_AWARE
 
 /**
  * The following 3 lock type definitions are trivial, just literal meaning
@@ -38,6 +49,9 @@ typedef struct {
 /**
  * Read-write lock is designed to parallel read threads instead of sequential execution
  * This implement use condition variable to wait/wake and requeue sleeping threads
+ * Besides the read and write ends there is an upgradable read end, held by at most one thread at a time:
+ * it shares the lock with readers but excludes writers, and can be turned into the write end without releasing,
+ * so a thread can search under it and only block readers once it decides to modify
  */
 #if defined(LOCK_PRWLOCK)
 typedef pthread_rwlock_t rwlock_t;
@@ -46,14 +60,49 @@ typedef struct {
     twophase_t mutex;       /**< serialize operations on rwlock */
     cond_t reader_lock;     /**< the cv for readers */
     cond_t writer_lock;     /**< the cv for writers */
-    unsigned readers;       /**< reader counter */
+    cond_t upgrader_lock;   /**< the cv for threads waiting for the upgradable read end */
+    cond_t drain_lock;      /**< the cv for the upgrader waiting for readers to leave */
+    unsigned readers;       /**< reader counter, not including the upgrader */
     unsigned writers;       /**< writer counter, should only be 0 or 1 */
+    unsigned upgraders;     /**< upgradable reader counter, should only be 0 or 1 */
+    unsigned upgrading;     /**< whether the upgrader is waiting in rwlock_upgrade */
     unsigned read_waiters;  /**< counter for waiters on the read end */
     unsigned write_waiters; /**< counter for waiters on the write end */
+    unsigned up_waiters;    /**< counter for waiters on the upgradable read end */
 } rwlock_t;
 #endif
 
 
+/**
+ * A reusable barrier, threads calling barrier_wait block until count of them arrived
+ * The phase flips when the last thread arrives, which releases the phase and starts the next one (sense reversal)
+ */
+typedef struct {
+    unsigned count;   /**< the number of threads to wait for */
+    unsigned arrived; /**< threads arrived in the current phase */
+    unsigned phase;   /**< futex word, incremented when a phase completes */
+    unsigned waiters; /**< threads sleeping on phase */
+} barrier_t;
+
+/**
+ * A counting semaphore
+ */
+typedef struct {
+    unsigned value;   /**< futex word, the number of available units */
+    unsigned waiters; /**< threads sleeping on value */
+} semaphore_t;
+
+/**
+ * An event threads can wait for
+ * A manual-reset event stays set and releases every waiter until event_reset, which also makes it a one-shot latch,
+ * an auto-reset event releases a single waiter and resets itself
+ */
+typedef struct {
+    unsigned state;     /**< futex word, 1 if set */
+    unsigned waiters;   /**< threads sleeping on state */
+    unsigned autoreset; /**< whether a released waiter resets the event */
+} event_t;
+
 /**
  * The generic lock type definition
  * Directly use existing lock types
@@ -70,30 +119,241 @@ typedef rwlock_t lock_t;
 typedef pthread_mutex_t lock_t;
 #elif defined(LOCK_PRWLOCK)
 typedef pthread_rwlock_t lock_t;
+#elif defined(LOCK_PARKING)
+typedef parklock_t lock_t;
 #endif
 
-void lock_init(lock_t *lock);
-void lock_acquire(lock_t *lock);
-void lock_release(lock_t *lock);
-
 void spinlock_init(spinlock_t *lock);
-void spinlock_acquire(spinlock_t *lock);
-void spinlock_release(spinlock_t *lock);
+void spinlock_acquire_slow(spinlock_t *lock);
 void mutex_init(mutex_t *lock);
-void mutex_acquire(mutex_t *lock);
+void mutex_acquire_slow(mutex_t *lock);
 void mutex_release(mutex_t *lock);
 void twophase_init(twophase_t *lock);
-void twophase_acquire(twophase_t *lock);
-void twophase_release(twophase_t *lock);
+void twophase_acquire_slow(twophase_t *lock);
+void twophase_release_slow(twophase_t *lock);
+
+int futex_wait(unsigned *addr, unsigned val);
+int futex_wait_timed(unsigned *addr, unsigned val, long long timeout_ns);
+int futex_wake(unsigned *addr, int count);
 
 void cond_init(cond_t* cv);
 void cond_wait(cond_t* cv, twophase_t* mutex);
 void cond_signal(cond_t* cv);
 void cond_broadcast(cond_t* cv);
 
+void barrier_init(barrier_t *barrier, unsigned count);
+int barrier_wait(barrier_t *barrier);
+int barrier_wait_last(barrier_t *barrier, void (*last)(void *arg), void *arg);
+
+void semaphore_init(semaphore_t *sem, unsigned value);
+int semaphore_trywait(semaphore_t *sem);
+void semaphore_wait(semaphore_t *sem);
+void semaphore_post(semaphore_t *sem);
+
+void event_init(event_t *event, int autoreset);
+void event_set(event_t *event);
+void event_reset(event_t *event);
+void event_wait(event_t *event);
+
 void rwlock_init(rwlock_t* self);
 void rwlock_rdlock(rwlock_t *lock);
 void rwlock_wrlock(rwlock_t *lock);
 void rwlock_unlock(rwlock_t* self);
+void rwlock_uplock(rwlock_t *lock);
+void rwlock_upunlock(rwlock_t *lock);
+void rwlock_upgrade(rwlock_t *lock);
+void rwlock_downgrade(rwlock_t *lock);
+
+/**
+ * Pause the cpu core using assembly code to avoid bad performance on some machine
+ */
+static inline void cpu_pause(void) {
+    asm volatile("pause\n": : :"memory");
+}
+
+/**
+ * Calling embedded assembly instruction "xchg"
+ * This instruction completes atomic operation of
+ * exchanging values from the pointer addr to the newval
+ * @param addr A pointer to the mutex value
+ * @param newval The new value to be swapped
+ * @return The previous value of the pointer addr referenced
+ */
+static inline unsigned xchg(void *addr, unsigned newval) {
+    asm volatile("xchgl %0, %1"
+    : "=r" (newval)
+    :"m" (*(volatile unsigned *)addr), "0" (newval)
+    :"memory");
+    return newval;
+}
+
+/**
+ * Calling embedded assembly instruction "cmpxchg"
+ * This instruction completes atomic operation of
+ * comparing the value of the pointer addr pointed with oldval,
+ * if equal, put newval into the position of the addr pointer and return to oldval
+ * return to the value pointed by addr instead
+ * @param addr A pointer to the mutex value
+ * @param oldval A value to be compared
+ * @param newval A value to write into addr
+ * @return oldval or *addr
+ */
+static inline unsigned cmpxchg(void *addr, unsigned int oldval, unsigned int newval) {
+    unsigned ret;
+    asm volatile("lock; cmpxchgl %1, %2"
+    : "=a" (ret)
+    : "r" (newval), "m" (*(volatile unsigned *)addr), "0" (oldval)
+    : "memory");
+    return ret;
+}
+
+#if defined(LOCK_PREEMPT_AWARE)
+/**
+ * The CPU the holder of a lock runs on
+ * Each lock publishes into the slot hashed from its address, locks sharing a slot overwrite each other,
+ * so waiters only take it as a hint
+ */
+typedef struct {
+    int cpu; /**< the CPU the holder acquired the lock on */
+} __attribute__((aligned(64))) lock_owner_t;
+
+#define LOCK_OWNER_BITS 8
+
+extern lock_owner_t lock_owners[1 << LOCK_OWNER_BITS];
+
+void lock_owner_publish(const void *lock);
+
+/**
+ * Select the owner slot of a lock with a Fibonacci hash
+ */
+static inline lock_owner_t *lock_owner(const void *lock) {
+    return &lock_owners[((unsigned long)lock * 11400714819323198485UL) >> (64 - LOCK_OWNER_BITS)];
+}
+#endif
+
+/**
+ * The acquire and release fast paths below are inlined into every caller,
+ * only contended operations call the out-of-line slow paths in lock.c
+ */
+
+/**
+ * Try to acquire the given spin-lock
+ * If the lock currently not available, this function will keep trying until somebody release the lock
+ * @param lock Pointer to the spin-lock want to obtain
+ */
+static inline void spinlock_acquire(spinlock_t *lock) {
+    if (xchg(lock, 1) != 0) {
+        spinlock_acquire_slow(lock);
+    }
+#if defined(LOCK_PREEMPT_AWARE)
+    lock_owner_publish(lock);
+#endif
+}
+
+/**
+ * Release the given spin-lock
+ * Notice that release a lock not hold by itself will cause unpredictable result
+ * @param lock Pointer to the spin-lock want to release
+ */
+static inline void spinlock_release(spinlock_t *lock) {
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Try to acquire the given mutex
+ * A failed try will cause the thread sleep until another thread wake it by releasing this mutex
+ * @param lock Pointer to the mutex want to obtain
+ */
+static inline void mutex_acquire(mutex_t *lock) {
+    if (xchg(lock, 1) != 0) {
+        mutex_acquire_slow(lock);
+    }
+}
+
+/**
+ * Acquire the given two-phase lock
+ * An uncontended lock is taken with a single cmpxchg, otherwise spin then sleep in the slow path
+ * @param lock Pointer to the two-phase lock want to obtain
+ */
+static inline void twophase_acquire(twophase_t *lock) {
+    if (cmpxchg(lock, 0, 1) != 0) {
+        twophase_acquire_slow(lock);
+    }
+#if defined(LOCK_PREEMPT_AWARE)
+    lock_owner_publish(lock);
+#endif
+}
+
+/**
+ * Release the given two-phase lock
+ * If no thread was marked as sleeping (lock == 1) the release is a single xchg,
+ * otherwise the slow path hands the lock over or wakes a sleeper
+ * @param lock Pointer to the two-phase lock want to release
+ */
+static inline void twophase_release(twophase_t *lock) {
+    if (xchg(lock, 0) != 1) {
+        twophase_release_slow(lock);
+    }
+}
+
+/**
+ * The generic lock initialization method
+ * The lock type is designated by the macros defined above
+ * @param lock A pointer to the lock to be initialized
+ */
+static inline void lock_init(lock_t* lock) {
+#if defined(LOCK_MUTEX)
+    mutex_init(lock);
+#elif defined(LOCK_SPIN)
+    spinlock_init(lock);
+#elif defined(LOCK_TWOPHASE)
+    twophase_init(lock);
+#elif defined(LOCK_PTHREAD)
+    pthread_mutex_init(lock, NULL);
+#elif defined(LOCK_PARKING)
+    parklock_init(lock);
+#elif defined(LOCK_RWLOCK) || defined(LOCK_PRWLOCK)
+    rwlock_init(lock);
+#endif
+}
+
+/**
+ * The generic lock acquire method
+ * Note that read-write locks DO NOT call this function
+ * @param lock A pointer to the lock to be acquired
+ */
+static inline void lock_acquire(lock_t* lock) {
+#if defined(LOCK_MUTEX)
+    mutex_acquire(lock);
+#elif defined(LOCK_SPIN)
+    spinlock_acquire(lock);
+#elif defined(LOCK_TWOPHASE)
+    twophase_acquire(lock);
+#elif defined(LOCK_PTHREAD)
+    pthread_mutex_lock(lock);
+#elif defined(LOCK_PARKING)
+    parklock_acquire(lock);
+#endif
+}
+
+/**
+ * The generic lock release method
+ * @param lock A pointer to the lock to be released
+ */
+static inline void lock_release(lock_t* lock) {
+#if defined(LOCK_MUTEX)
+    mutex_release(lock);
+#elif defined(LOCK_SPIN)
+    spinlock_release(lock);
+#elif defined(LOCK_TWOPHASE)
+    twophase_release(lock);
+#elif defined(LOCK_PTHREAD)
+    pthread_mutex_unlock(lock);
+#elif defined(LOCK_PARKING)
+    parklock_release(lock);
+#elif defined(LOCK_RWLOCK) || defined(LOCK_PRWLOCK)
+    rwlock_unlock(lock);
+#endif
+}
 
 #endif //P4_LOCK_H
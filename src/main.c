@@ -1,72 +1,208 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
 #include <pthread.h>
-#include <sys/time.h>
+#include <sched.h>
+#include <unistd.h>
 
 #include "counter.h"
 #include "list.h"
 #include "hash.h"
+#include "queue.h"
+#include "dhash.h"
+#include "thash.h"
+#include "rng.h"
+#include "latency.h"
+#include "affinity.h"
+#include "perf.h"
+#include "trace.h"
 
-struct timeval tvb, tve;
+unsigned long long timer_begin;
 void startTimer() {
-    gettimeofday(&tvb, NULL);
+    timer_begin = latency_now();
 }
 
 double endTimer() {
-    gettimeofday(&tve, NULL);
-    return (tve.tv_sec - tvb.tv_sec) * 1000 + (tve.tv_usec - tvb.tv_usec) / 1000.0;
+    return (latency_now() - timer_begin) / 1000000.0;
 }
 
+/**
+ * Set by a teardown whose correctness check failed, the results are still printed but P4 exits with 1
+ */
+int CHECK_FAILED = 0;
+
+/**
+ * Workload parameters, the defaults can be overridden from the command line (see usage)
+ */
 int THREAD_COUNT = 4;
 int MAX_N = 20000;
-#define SEED 1551
-#define HASH_SIZE 1000
+unsigned int SEED = 1551;
+int HASH_SIZE = 1000;
+hash_func_t HASH_FUNC = HASH_FUNC_MOD;
+
+int READ_RATE = 70;
+int INSERT_RATE = 15;
+int RANGE = 1000;
+int UNIQUE = 0; /**< inserts of the list and hash workloads skip keys already present */
 
-#define READ_RATE 70
-#define INSERT_RATE 15
-#define RANGE 1000
+dist_type_t KEY_DIST_TYPE = DIST_UNIFORM;
+double ZIPF_THETA = 0.99;
+double HOT_KEYS = 0.2;
+double HOT_OPS = 0.8;
+keydist_t KEY_DIST;
 
 counter_t counter;
 list_t list;
 hash_t hash;
 
+/**
+ * The value stored by the hash-kv benchmark, derived from its key so lookups can check the copy they got
+ */
+typedef struct {
+    unsigned int key;           /**< the key the value is stored under */
+    unsigned int writer;        /**< the thread that stored the value */
+    unsigned long long payload; /**< KV_PAYLOAD of the key */
+} kv_value_t;
+
+#define KV_HASH(key) (key)
+#define KV_EQUAL(a, b) ((a) == (b))
+#define KV_PAYLOAD(key) ((unsigned long long)(key) * 0x9e3779b97f4a7c15ULL)
+
+THASH_DEFINE(kvhash, unsigned int, kv_value_t, KV_HASH, KV_EQUAL)
+
+kvhash_t kvhash;
+unsigned long KV_MISMATCHES = 0; /**< lookups of hash-kv that copied out a value of another key */
+
+/**
+ * Per-operation latency recording, enabled by --latency
+ * LATENCY holds OP_TYPES histograms for every thread, index with thread * OP_TYPES + op
+ */
+#define OP_READ 0
+#define OP_INSERT 1
+#define OP_DELETE 2
+#define OP_TYPES 3
+int LATENCY_ON = 0;
+latency_t *LATENCY = NULL;
+
+/**
+ * Fixed-duration mode, enabled by --duration
+ * Workers run until STOP is set and publish their operation count in PROGRESS,
+ * the main thread samples the counts every INTERVAL_MS after a WARMUP_MS warm-up phase
+ */
+#define MAX_THREADS 256
+
+/**
+ * --oversubscribe runs 1 to OVERSUBSCRIBE_MAX threads per online CPU
+ */
+#define OVERSUBSCRIBE_MAX 8
+typedef struct {
+    unsigned long long ops; /**< operations completed by the thread, written only by its owner */
+} __attribute__((aligned(64))) progress_t;
+
+int DURATION_MS = 0;
+int WARMUP_MS = 0;
+int INTERVAL_MS = 100;
+int STOP = 0;
+int WARMING = 0;
+progress_t PROGRESS[MAX_THREADS];
+unsigned long long MEASURED[MAX_THREADS]; /**< per-thread operations in the measured window of the last run */
+double *SERIES = NULL;                      /**< aggregate ops/sec of each interval of the last run */
+int SERIES_N = 0;
+
+/**
+ * The loop condition of workers
+ * In fixed-operation mode, run MAX_N iterations; in duration mode, publish progress and run until stopped
+ * @param id The thread index
+ * @param i The number of iterations done so far
+ * @return Whether to run another iteration
+ */
+static inline int running(int id, long i) {
+    if (DURATION_MS == 0) {
+        return i < MAX_N;
+    }
+    __atomic_store_n(&PROGRESS[id].ops, (unsigned long long)i, __ATOMIC_RELAXED);
+    return !__atomic_load_n(&STOP, __ATOMIC_RELAXED);
+}
+
+/**
+ * Operation trace recording, only compiled into the instrumented build (make P4-trace) and enabled by --record
+ */
+#ifdef P4_TRACE
+char *RECORD_PATH = NULL;
+trace_buffer_t TRACE_BUF[MAX_THREADS];
+#define RECORD(id, op, key) do { \
+    if (RECORD_PATH != NULL) { \
+        trace_append(&TRACE_BUF[id], latency_now(), id, op, key); \
+    } \
+} while (0)
+#else
+#define RECORD(id, op, key) do { } while (0)
+#endif
+
+/**
+ * Run stmt as operation op on key of thread id, timing it when latency recording is on
+ * Nothing is recorded during the warm-up phase
+ */
+#define TIMED(id, op, key, stmt) do { \
+    RECORD(id, op, key); \
+    if (LATENCY_ON && !__atomic_load_n(&WARMING, __ATOMIC_RELAXED)) { \
+        unsigned long long _begin = latency_now(); \
+        stmt; \
+        latency_record(&LATENCY[(id) * OP_TYPES + (op)], latency_now() - _begin); \
+    } else { \
+        stmt; \
+    } \
+} while (0)
+
 void* test_lock(void *args) {
-    int i;
-    for (i = 0; i < MAX_N; i++) {
-        counter_increment(&counter);
+    long i;
+    int id = (int)(unsigned long)args;
+    for (i = 0; running(id, i); i++) {
+        TIMED(id, OP_INSERT, 0, counter_increment(&counter));
     }
     return NULL;
 }
 
 void* test_counter(void *args) {
-    int i;
-    srand(SEED + (unsigned)(unsigned long)args);
-    for (i = 0; i < MAX_N; i++) {
-        int rd = rand() % 100;
+    long i;
+    int id = (int)(unsigned long)args;
+    rng_t rng;
+    rng_seed(&rng, SEED + (unsigned)(unsigned long)args);
+    for (i = 0; running(id, i); i++) {
+        int rd = rng_below(&rng, 100);
         if (rd < READ_RATE) {
-            counter_get_value(&counter);
+            TIMED(id, OP_READ, 0, counter_get_value(&counter));
         } else if (rd < READ_RATE + INSERT_RATE) {
-            counter_increment(&counter);
+            TIMED(id, OP_INSERT, 0, counter_increment(&counter));
         } else {
-            counter_decrement(&counter);
+            TIMED(id, OP_DELETE, 0, counter_decrement(&counter));
         }
     }
     return NULL;
 }
 
 void* test_list(void *args) {
-    int i;
-    srand(SEED + (unsigned)(unsigned long)args);
-    for (i = 0; i < MAX_N; i++) {
-        int rd = rand() % 100;
+    long i;
+    int id = (int)(unsigned long)args;
+    keygen_t gen;
+    keygen_init(&gen, &KEY_DIST, SEED, id, THREAD_COUNT);
+    for (i = 0; running(id, i); i++) {
+        int rd = rng_below(&gen.rng, 100);
         if (rd < READ_RATE) {
-            list_lookup(&list, (unsigned)(rand() % RANGE));
+            unsigned int key = keygen_next(&gen);
+            TIMED(id, OP_READ, key, list_lookup(&list, key));
         } else if (rd < READ_RATE + INSERT_RATE) {
-            int value = rand() % RANGE;
-            list_insert(&list, (unsigned)value);
+            unsigned int key = keygen_next_insert(&gen);
+            if (UNIQUE) {
+                TIMED(id, OP_INSERT, key, list_insert_unique(&list, key));
+            } else {
+                TIMED(id, OP_INSERT, key, list_insert(&list, key));
+            }
         } else {
-            int value = rand() % RANGE;
-            list_delete(&list, (unsigned)value);
+            unsigned int key = keygen_next(&gen);
+            TIMED(id, OP_DELETE, key, list_delete(&list, key));
         }
     }
     return NULL;
@@ -74,31 +210,67 @@ void* test_list(void *args) {
 
 void* test_list_order(void *args) {
     int i;
-    srand(SEED + (unsigned)(unsigned long)args);
+    int id = (int)(unsigned long)args;
+    keygen_t gen;
+    keygen_init(&gen, &KEY_DIST, SEED, id, THREAD_COUNT);
     for (i = 0; i < MAX_N; i++) {
-        int value = rand() % RANGE;
-        list_insert(&list, (unsigned) value);
+        unsigned int key = keygen_next_insert(&gen);
+        TIMED(id, OP_INSERT, key, list_insert(&list, key));
     }
     for (i = 0; i < MAX_N; i++) {
-        int value = rand() % RANGE;
-        list_delete(&list, (unsigned) value);
+        unsigned int key = keygen_next(&gen);
+        TIMED(id, OP_DELETE, key, list_delete(&list, key));
     }
     return NULL;
 }
 
 void* test_hash(void *args) {
-    int i;
-    srand(SEED + (unsigned)(unsigned long)args);
-    for (i = 0; i < MAX_N; i++) {
-        int rd = rand() % 100;
+    long i;
+    int id = (int)(unsigned long)args;
+    keygen_t gen;
+    keygen_init(&gen, &KEY_DIST, SEED, id, THREAD_COUNT);
+    for (i = 0; running(id, i); i++) {
+        int rd = rng_below(&gen.rng, 100);
         if (rd < READ_RATE) {
-            hash_lookup(&hash, (unsigned)(rand() % RANGE));
+            unsigned int key = keygen_next(&gen);
+            TIMED(id, OP_READ, key, hash_lookup(&hash, key));
         } else if (rd < READ_RATE + INSERT_RATE) {
-            int value = rand() % RANGE;
-            hash_insert(&hash, (unsigned)value);
+            unsigned int key = keygen_next_insert(&gen);
+            if (UNIQUE) {
+                TIMED(id, OP_INSERT, key, hash_insert_unique(&hash, key));
+            } else {
+                TIMED(id, OP_INSERT, key, hash_insert(&hash, key));
+            }
         } else {
-            int value = rand() % RANGE;
-            hash_delete(&hash, (unsigned)value);
+            unsigned int key = keygen_next(&gen);
+            TIMED(id, OP_DELETE, key, hash_delete(&hash, key));
+        }
+    }
+    return NULL;
+}
+
+void* test_hash_kv(void *args) {
+    long i;
+    int id = (int)(unsigned long)args;
+    keygen_t gen;
+    keygen_init(&gen, &KEY_DIST, SEED, id, THREAD_COUNT);
+    for (i = 0; running(id, i); i++) {
+        int rd = rng_below(&gen.rng, 100);
+        if (rd < READ_RATE) {
+            unsigned int key = keygen_next(&gen);
+            kv_value_t value;
+            int found;
+            TIMED(id, OP_READ, key, found = kvhash_get(&kvhash, key, &value));
+            if (found && (value.key != key || value.payload != KV_PAYLOAD(key))) {
+                __atomic_fetch_add(&KV_MISMATCHES, 1, __ATOMIC_RELAXED);
+            }
+        } else if (rd < READ_RATE + INSERT_RATE) {
+            unsigned int key = keygen_next_insert(&gen);
+            kv_value_t value = {key, (unsigned int)id, KV_PAYLOAD(key)};
+            TIMED(id, OP_INSERT, key, kvhash_put(&kvhash, key, value));
+        } else {
+            unsigned int key = keygen_next(&gen);
+            TIMED(id, OP_DELETE, key, kvhash_delete(&kvhash, key, NULL));
         }
     }
     return NULL;
@@ -106,201 +278,1313 @@ void* test_hash(void *args) {
 
 void* test_hash_order(void *args) {
     int i;
-    srand(SEED + (unsigned)(unsigned long)args);
+    int id = (int)(unsigned long)args;
+    keygen_t gen;
+    keygen_init(&gen, &KEY_DIST, SEED, id, THREAD_COUNT);
     for (i = 0; i < MAX_N; i++) {
-        int value = rand() % RANGE;
-        hash_insert(&hash, (unsigned) value);
+        unsigned int key = keygen_next_insert(&gen);
+        TIMED(id, OP_INSERT, key, hash_insert(&hash, key));
     }
     for (i = 0; i < MAX_N; i++) {
-        int value = rand() % RANGE;
-        hash_delete(&hash, (unsigned) value);
+        unsigned int key = keygen_next(&gen);
+        TIMED(id, OP_DELETE, key, hash_delete(&hash, key));
     }
     return NULL;
 }
 
-double timeTotal[100];
+double timeTotal[MAX_THREADS];
 
 void* test_exec(void *args) {
-    int i;
+    long i;
     int id = (int)(unsigned long)args;
-    struct timeval tvb, tve;
-    gettimeofday(&tvb, NULL);
-    for (i = 0; i < MAX_N; i++) {
-        counter_increment(&counter);
+    unsigned long long begin = latency_now();
+    for (i = 0; running(id, i); i++) {
+        TIMED(id, OP_INSERT, 0, counter_increment(&counter));
     }
-    gettimeofday(&tve, NULL);
-    timeTotal[id] = (tve.tv_usec - tvb.tv_usec) / 1000.0 + (tve.tv_sec - tvb.tv_sec) * 1000.0;
+    timeTotal[id] = (latency_now() - begin) / 1000000.0;
     return NULL;
 }
 
+/**
+ * Accumulate the time every increment takes, reading the clock only once per iteration
+ */
 void* test_acquire(void *args) {
-    int i;
+    long i;
     int id = (int)(unsigned long)args;
-    timeTotal[id] = 0;
-    struct timeval tvb, tve;
-    for (i = 0; i < MAX_N; i++) {
-        gettimeofday(&tve, NULL);
-        if (i > 0) {
-            timeTotal[id] += (tve.tv_usec - tvb.tv_usec) / 1000.0 + (tve.tv_sec - tvb.tv_sec) * 1000.0;
-        }
-        gettimeofday(&tvb, NULL);
+    unsigned long long total = 0, now, last = latency_now();
+    for (i = 0; running(id, i); i++) {
+        RECORD(id, OP_INSERT, 0);
         counter_increment(&counter);
+        now = latency_now();
+        total += now - last;
+        if (LATENCY_ON && !__atomic_load_n(&WARMING, __ATOMIC_RELAXED)) {
+            latency_record(&LATENCY[id * OP_TYPES + OP_INSERT], now - last);
+        }
+        last = now;
     }
+    timeTotal[id] = total / 1000000.0;
     return NULL;
 }
 
-void lock_performance() {
-    int i;
-    counter_init(&counter, 0);
-    pthread_t* threads = malloc(sizeof(pthread_t)*THREAD_COUNT);
+/**
+ * Producer/consumer queue benchmarks
+ * The first producer_count() threads enqueue and the others dequeue, MAX_N * THREAD_COUNT / 2 items in total,
+ * so a thread does MAX_N operations on average; a single thread enqueues and dequeues alternately
+ */
+int PRODUCERS = 0;           /**< producer threads, 0 splits the threads evenly */
+int QUEUE_CAPACITY = 1024;   /**< capacity of the ring */
+ring_t ring;
+msqueue_t msqueue;
+unsigned long long QUEUE_SENT = 0;     /**< sum of the enqueued items */
+unsigned long long QUEUE_RECEIVED = 0; /**< sum of the dequeued items, must match QUEUE_SENT after a run */
 
-    startTimer();
+int producer_count() {
+    int producers = PRODUCERS > 0 ? PRODUCERS : THREAD_COUNT / 2;
+    if (THREAD_COUNT == 1) {
+        return 1;
+    }
+    if (producers < 1) {
+        producers = 1;
+    }
+    return producers < THREAD_COUNT ? producers : THREAD_COUNT - 1;
+}
+
+/**
+ * The number of items thread k of n moves when they share total items
+ */
+long queue_share(long total, int n, int k) {
+    return total / n + (k < total % n);
+}
+
+static void ring_put(void *value) {
+    ring_enqueue(&ring, value);
+}
+
+static void *ring_get(void) {
+    return ring_dequeue(&ring);
+}
+
+static void msqueue_put(void *value) {
+    msqueue_enqueue(&msqueue, value);
+}
+
+/**
+ * The two-lock queue never blocks, an empty queue yields the CPU to the producers instead
+ */
+static void *msqueue_get(void) {
+    void *value;
+    while (!msqueue_dequeue(&msqueue, &value)) {
+        sched_yield();
+    }
+    return value;
+}
+
+/**
+ * The body of both queue workers, put and get are constant at each call site so they get inlined
+ */
+static inline void queue_run(int id, void (*put)(void *), void *(*get)(void)) {
+    long i, n;
+    int producers = producer_count();
+    long items = (long)MAX_N * THREAD_COUNT / 2;
+    unsigned long long sent = 0, received = 0;
+    void *value;
+    if (THREAD_COUNT == 1) {
+        for (i = 0; i < items; i++) {
+            TIMED(id, OP_INSERT, (unsigned)(i + 1), put((void *)(unsigned long)(i + 1)));
+            TIMED(id, OP_READ, 0, value = get());
+            sent += i + 1;
+            received += (unsigned long)value;
+        }
+    } else if (id < producers) {
+        n = queue_share(items, producers, id);
+        for (i = 0; i < n; i++) {
+            TIMED(id, OP_INSERT, (unsigned)(i + 1), put((void *)(unsigned long)(i + 1)));
+            sent += i + 1;
+        }
+    } else {
+        n = queue_share(items, THREAD_COUNT - producers, id - producers);
+        for (i = 0; i < n; i++) {
+            TIMED(id, OP_READ, 0, value = get());
+            received += (unsigned long)value;
+        }
+    }
+    __atomic_fetch_add(&QUEUE_SENT, sent, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&QUEUE_RECEIVED, received, __ATOMIC_RELAXED);
+}
+
+void* test_ring(void *args) {
+    queue_run((int)(unsigned long)args, ring_put, ring_get);
+    return NULL;
+}
+
+void* test_msqueue(void *args) {
+    queue_run((int)(unsigned long)args, msqueue_put, msqueue_get);
+    return NULL;
+}
+
+/**
+ * Delegated hash benchmark
+ * Every thread is a client keeping up to INFLIGHT requests in flight, the SHARDS server threads run on top of them
+ * With latency recording on, a request is tagged with its submit time and timed until its completion is collected
+ */
+#define DHASH_COLLECT 64
+int SHARDS = 2;
+int INFLIGHT = 64;
+int COMPLETION_WAIT = 0; /**< collect completions with dhash_wait instead of polling */
+dhash_t dhash;
+
+/**
+ * Collect at least one completion of the client, recording the latency of each
+ * @return The number of completions collected
+ */
+int dhash_complete(int id) {
+    int i, n;
+    dhash_msg_t done[DHASH_COLLECT];
+    if (COMPLETION_WAIT) {
+        n = dhash_wait(&dhash, id, done, DHASH_COLLECT);
+    } else {
+        while ((n = dhash_poll(&dhash, id, done, DHASH_COLLECT)) == 0) {
+            cpu_pause();
+        }
+    }
+    if (LATENCY_ON && !__atomic_load_n(&WARMING, __ATOMIC_RELAXED)) {
+        unsigned long long now = latency_now();
+        for (i = 0; i < n; i++) {
+            int op = done[i].op == DHASH_LOOKUP ? OP_READ : done[i].op == DHASH_INSERT ? OP_INSERT : OP_DELETE;
+            latency_record(&LATENCY[id * OP_TYPES + op], now - done[i].tag);
+        }
+    }
+    return n;
+}
+
+void* test_dhash(void *args) {
+    long i, inflight = 0;
+    int id = (int)(unsigned long)args;
+    keygen_t gen;
+    keygen_init(&gen, &KEY_DIST, SEED, id, THREAD_COUNT);
+    for (i = 0; running(id, i); i++) {
+        int rd = rng_below(&gen.rng, 100);
+        unsigned int key;
+        dhash_op_t op;
+        if (rd < READ_RATE) {
+            key = keygen_next(&gen);
+            op = DHASH_LOOKUP;
+        } else if (rd < READ_RATE + INSERT_RATE) {
+            key = keygen_next_insert(&gen);
+            op = DHASH_INSERT;
+        } else {
+            key = keygen_next(&gen);
+            op = DHASH_DELETE;
+        }
+        RECORD(id, op == DHASH_LOOKUP ? OP_READ : op == DHASH_INSERT ? OP_INSERT : OP_DELETE, key);
+        unsigned long tag = LATENCY_ON ? latency_now() : (unsigned long)i;
+        while (inflight >= INFLIGHT || !dhash_submit(&dhash, id, op, key, tag)) {
+            inflight -= dhash_complete(id);
+        }
+        inflight++;
+    }
+    while (inflight > 0) {
+        inflight -= dhash_complete(id);
+    }
+    return NULL;
+}
+
+/**
+ * Trace replay, enabled by --replay
+ * Thread r replays the records of every recorded thread t with t % THREAD_COUNT == r,
+ * split into REPLAY_PARTS once per thread count before any run is timed
+ */
+char *REPLAY_PATH = NULL;
+int REPLAY_ORIGINAL = 0;
+trace_t TRACE;
+trace_part_t REPLAY_PARTS[MAX_THREADS];
+void (*REPLAY_OP)(int id, int op, unsigned int key) = NULL;
+
+void replay_counter(int id, int op, unsigned int key) {
+    if (op == OP_READ) {
+        TIMED(id, OP_READ, 0, counter_get_value(&counter));
+    } else if (op == OP_INSERT) {
+        TIMED(id, OP_INSERT, 0, counter_increment(&counter));
+    } else {
+        TIMED(id, OP_DELETE, 0, counter_decrement(&counter));
+    }
+}
+
+void replay_list(int id, int op, unsigned int key) {
+    if (op == OP_READ) {
+        TIMED(id, OP_READ, key, list_lookup(&list, key));
+    } else if (op == OP_INSERT) {
+        TIMED(id, OP_INSERT, key, list_insert(&list, key));
+    } else {
+        TIMED(id, OP_DELETE, key, list_delete(&list, key));
+    }
+}
+
+void replay_hash(int id, int op, unsigned int key) {
+    if (op == OP_READ) {
+        TIMED(id, OP_READ, key, hash_lookup(&hash, key));
+    } else if (op == OP_INSERT) {
+        TIMED(id, OP_INSERT, key, hash_insert(&hash, key));
+    } else {
+        TIMED(id, OP_DELETE, key, hash_delete(&hash, key));
+    }
+}
+
+/**
+ * Busy-wait, or sleep when far enough away, until the monotonic clock reaches target
+ */
+void wait_until(unsigned long long target) {
+    unsigned long long now;
+    while ((now = latency_now()) < target) {
+        if (target - now > 200000) {
+            struct timespec ts = {0, (long)(target - now - 100000)};
+            nanosleep(&ts, NULL);
+        }
+    }
+}
+
+void* test_replay(void *args) {
+    int id = (int)(unsigned long)args;
+    const trace_part_t *part = &REPLAY_PARTS[id];
+    unsigned long long j, begin = latency_now();
+    for (j = 0; j < part->n; j++) {
+        const trace_record_t *record = &part->records[j];
+        if (REPLAY_ORIGINAL) {
+            wait_until(begin + record->time);
+        }
+        REPLAY_OP(id, record->op, record->key);
+    }
+    return NULL;
+}
+
+/**
+ * Thread placement, PLACE_CPUS lists the CPUs in the order threads are pinned to them
+ */
+placement_t PLACEMENT = PLACE_NONE;
+int PLACE_CPUS[MAX_THREADS];
+int PLACE_CPU_COUNT = 0;
+
+barrier_t start_barrier;
+
+/**
+ * Hardware counters, enabled by --perf
+ * Every worker opens its own counters, the main thread enables and disables them around the measured phase
+ */
+int PERF_ON = 0;
+perf_t PERF[MAX_THREADS];
+perf_counts_t PERF_COUNTS; /**< counts summed over threads and runs, reset by the caller */
+
+void perf_enable_all() {
+    int i;
     for (i = 0; i < THREAD_COUNT; i++) {
-        pthread_create(&threads[i], NULL, test_lock, (void *)(unsigned long) i);
+        perf_enable(&PERF[i]);
     }
+}
+
+void perf_disable_all() {
+    int i;
     for (i = 0; i < THREAD_COUNT; i++) {
-        pthread_join(threads[i], NULL);
+        perf_disable(&PERF[i]);
     }
+}
+
+/**
+ * The argument of thread_main
+ */
+typedef struct {
+    void *(*worker)(void *); /**< the benchmark worker */
+    int id;                  /**< the thread index */
+} thread_arg_t;
 
-    //printf("Lock runtime:\n");
-    printf("%f, ", endTimer());
+/**
+ * Start the clock of a fixed-operation run, called by the last thread arriving at the start barrier
+ * before it releases the others, so neither thread start-up nor a worker's head start escapes the timing
+ * Duration mode times its own window in monitor_run
+ */
+void start_clock(void *arg) {
+    if (DURATION_MS == 0) {
+        startTimer();
+    }
 }
 
-void counter_performance() {
+/**
+ * Pin the thread according to the placement policy, then wait until all threads are ready to start
+ * @param args A pointer to thread_arg_t
+ */
+void* thread_main(void *args) {
+    thread_arg_t *arg = args;
+    if (PLACEMENT != PLACE_NONE && PLACE_CPU_COUNT > 0) {
+        affinity_pin(PLACE_CPUS[arg->id % PLACE_CPU_COUNT]);
+    }
+    if (PERF_ON) { // the main thread enables the counters between the two barriers
+        perf_open(&PERF[arg->id]);
+        barrier_wait(&start_barrier);
+    }
+    barrier_wait_last(&start_barrier, start_clock, NULL);
+    return arg->worker((void *)(unsigned long) arg->id);
+}
+
+/**
+ * Sleep for the given number of milliseconds
+ */
+void sleep_ms(long ms) {
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000};
+    while (nanosleep(&ts, &ts) != 0);
+}
+
+/**
+ * Sum the published progress of all threads
+ */
+unsigned long long total_progress(unsigned long long *each) {
     int i;
-    counter_init(&counter, 0);
-    pthread_t* threads = malloc(sizeof(pthread_t)*THREAD_COUNT);
+    unsigned long long sum = 0;
+    for (i = 0; i < THREAD_COUNT; i++) {
+        each[i] = __atomic_load_n(&PROGRESS[i].ops, __ATOMIC_RELAXED);
+        sum += each[i];
+    }
+    return sum;
+}
+
+/**
+ * Drive a fixed-duration run while the workers are going
+ * Waits out the warm-up, then samples aggregate throughput every INTERVAL_MS into SERIES until DURATION_MS
+ * has passed, and finally raises STOP. Per-thread operations of the measured window are left in MEASURED
+ * @return The length of the measured window, in ms
+ */
+double monitor_run() {
+    int i, k = 0;
+    unsigned long long base[MAX_THREADS], now[MAX_THREADS];
+    sleep_ms(WARMUP_MS);
+    __atomic_store_n(&WARMING, 0, __ATOMIC_RELAXED);
+    if (PERF_ON && WARMUP_MS > 0) {
+        perf_enable_all();
+    }
 
+    unsigned long long last = total_progress(base);
     startTimer();
-    for (i = 0; i < THREAD_COUNT; i++) {
-        pthread_create(&threads[i], NULL, test_counter, (void *)(unsigned long) i);
+    double elapsed = 0, mark = 0;
+    while (elapsed < DURATION_MS) {
+        long wait = INTERVAL_MS < DURATION_MS - (long)elapsed ? INTERVAL_MS : DURATION_MS - (long)elapsed;
+        sleep_ms(wait > 0 ? wait : 1);
+        unsigned long long sum = total_progress(now);
+        elapsed = endTimer();
+        if (k < SERIES_N) {
+            SERIES[k++] = (sum - last) / ((elapsed - mark) / 1000);
+        }
+        last = sum;
+        mark = elapsed;
+    }
+    __atomic_store_n(&STOP, 1, __ATOMIC_RELAXED);
+    if (PERF_ON) {
+        perf_disable_all();
     }
     for (i = 0; i < THREAD_COUNT; i++) {
-        pthread_join(threads[i], NULL);
+        MEASURED[i] = now[i] - base[i];
     }
-
-    //printf("Counter runtime:\n");
-    printf("%f, ", endTimer());
+    return elapsed;
 }
 
-void list_performance() {
+/**
+ * Run the given worker on THREAD_COUNT threads and wait for all of them
+ * Threads are created and pinned first, then released together by a barrier, so early threads don't run alone
+ * @param worker The thread function, receives its thread index as argument
+ * In duration mode, the measured window is driven by monitor_run instead
+ * @return The wall time from the last thread reaching the start barrier to joining the last one,
+ *         or the measured window, in ms
+ */
+double run_threads(void *(*worker)(void *)) {
     int i;
-    list_init(&list);
+    double elapsed;
     pthread_t* threads = malloc(sizeof(pthread_t)*THREAD_COUNT);
+    thread_arg_t* args = malloc(sizeof(thread_arg_t)*THREAD_COUNT);
 
-    startTimer();
+    STOP = 0;
+    WARMING = DURATION_MS > 0 && WARMUP_MS > 0;
     for (i = 0; i < THREAD_COUNT; i++) {
-        pthread_create(&threads[i], NULL, test_list, (void *)(unsigned long) i);
-        //pthread_create(&threads[i], NULL, test_list_order, (void *)(unsigned long) i);
+        PROGRESS[i].ops = 0;
     }
+    barrier_init(&start_barrier, THREAD_COUNT + 1);
     for (i = 0; i < THREAD_COUNT; i++) {
-        pthread_join(threads[i], NULL);
+        args[i].worker = worker;
+        args[i].id = i;
+        pthread_create(&threads[i], NULL, thread_main, &args[i]);
     }
+    if (PERF_ON) {
+        barrier_wait(&start_barrier);
+        if (!WARMING) {
+            perf_enable_all();
+        }
+    }
+    barrier_wait_last(&start_barrier, start_clock, NULL);
+    if (DURATION_MS > 0) {
+        elapsed = monitor_run();
+        for (i = 0; i < THREAD_COUNT; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    } else {
+        for (i = 0; i < THREAD_COUNT; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        elapsed = endTimer();
+    }
+    for (i = 0; PERF_ON && i < THREAD_COUNT; i++) { // counters of exited threads keep their values
+        perf_read(&PERF[i], &PERF_COUNTS);
+        perf_close(&PERF[i]);
+    }
+
+    free(args);
+    free(threads);
+    return elapsed;
+}
+
+void counter_setup() {
+    counter_init(&counter, 0);
+}
 
-    //printf("List runtime:\n");
-    printf("%f, ", endTimer());
+void list_setup() {
+    list_init(&list);
+}
+
+void list_teardown() {
     list_destroy(&list);
 }
 
-void hash_performance() {
+void hash_setup() {
+    if (hash_init_func(&hash, HASH_SIZE, HASH_FUNC) < 0) {
+        exit(1);
+    }
+}
+
+void hash_teardown() {
+    hash_destroy(&hash);
+}
+
+void kvhash_setup() {
+    if (kvhash_init(&kvhash, HASH_SIZE) < 0) {
+        exit(1);
+    }
+}
+
+void kvhash_teardown() {
+    if (KV_MISMATCHES != 0) {
+        fprintf(stderr, "hash-kv lookups returned %lu values of other keys\n", KV_MISMATCHES);
+        CHECK_FAILED = 1;
+    }
+    KV_MISMATCHES = 0;
+    kvhash_destroy(&kvhash);
+}
+
+void queue_check() {
+    if (QUEUE_SENT != QUEUE_RECEIVED) {
+        fprintf(stderr, "queue lost items: sent sum %llu, received sum %llu\n", QUEUE_SENT, QUEUE_RECEIVED);
+        CHECK_FAILED = 1;
+    }
+    QUEUE_SENT = 0;
+    QUEUE_RECEIVED = 0;
+}
+
+void ring_setup() {
+    if (ring_init(&ring, (unsigned)QUEUE_CAPACITY) < 0) {
+        exit(1);
+    }
+}
+
+void ring_teardown() {
+    queue_check();
+    ring_destroy(&ring);
+}
+
+void msqueue_setup() {
+    msqueue_init(&msqueue);
+}
+
+void msqueue_teardown() {
+    queue_check();
+    msqueue_destroy(&msqueue);
+}
+
+void dhash_setup() {
+    int i, cpus[MAX_THREADS];
+    for (i = 0; i < SHARDS && i < MAX_THREADS; i++) { // servers take the CPUs after those of the clients
+        cpus[i] = PLACEMENT != PLACE_NONE && PLACE_CPU_COUNT > 0 ? PLACE_CPUS[(THREAD_COUNT + i) % PLACE_CPU_COUNT] : -1;
+    }
+    if (dhash_init(&dhash, SHARDS, THREAD_COUNT, HASH_SIZE, (unsigned)INFLIGHT, cpus) < 0) {
+        exit(1);
+    }
+}
+
+void dhash_teardown() {
+    dhash_destroy(&dhash);
+}
+
+/**
+ * Report the shape of a hash table filled by the hash workload, one row per thread count
+ * Histogram and hottest bucket lists are one CSV column separated by semicolons, or JSON arrays
+ * @param json Whether to print JSON
+ * @param first Whether this is the first row, which prints the CSV header or no JSON separator
+ * @return 0 on success
+ */
+int hash_statistics(int json, int first) {
     int i;
-    hash_init(&hash, HASH_SIZE);
-    pthread_t* threads = malloc(sizeof(pthread_t)*THREAD_COUNT);
+    hash_stats_t stats;
+    hash_setup();
+    run_threads(test_hash);
 
-    startTimer();
-    for (i = 0; i < THREAD_COUNT; i++) {
-        pthread_create(&threads[i], NULL, test_hash, (void *)(unsigned long) i);
-        //pthread_create(&threads[i], NULL, test_hash_order, (void *)(unsigned long) i);
+    hash_stats(&hash, &stats);
+    unsigned long per_bucket = stats.bucket_size > 0 ? stats.bucket_bytes / stats.bucket_size : 0;
+#if defined(LIST_STATS)
+    int j, hot, top[5];
+    for (hot = 0; hot < 5 && hot < stats.bucket_size; hot++) { // pick the busiest buckets one by one
+        top[hot] = -1;
+        for (i = 0; i < stats.bucket_size; i++) {
+            int picked = 0;
+            for (j = 0; j < hot; j++) {
+                picked |= top[j] == i;
+            }
+            if (!picked && (top[hot] < 0 || stats.bucket_ops[i] > stats.bucket_ops[top[hot]])) {
+                top[hot] = i;
+            }
+        }
     }
-    for (i = 0; i < THREAD_COUNT; i++) {
-        pthread_join(threads[i], NULL);
+#else
+    if (first) {
+        fprintf(stderr, "operations are not counted, define LIST_STATS in list.h to count them\n");
     }
+#endif
+    if (json) {
+        printf("%s  {\"bench\": \"hash-stats\", \"threads\": %d, \"keys\": %lld, \"load_factor\": %f, "
+               "\"chain_stddev\": %f, \"longest_chain\": %d, \"longest_bucket\": %d, \"node_bytes\": %lu, "
+               "\"bucket_bytes\": %lu, \"bytes_per_bucket\": %lu, \"lock_bytes\": %lu, \"histogram\": [",
+               first ? "" : ",\n", THREAD_COUNT, stats.keys, stats.load_factor, stats.chain_stddev,
+               stats.longest_chain, stats.longest_bucket, stats.node_bytes, stats.bucket_bytes, per_bucket,
+               stats.lock_bytes);
+        for (i = 0; i < HASH_HIST_SIZE; i++) {
+            printf("%s%d", i ? ", " : "", stats.histogram[i]);
+        }
+#if defined(LIST_STATS)
+        printf("], \"ops\": %llu, \"hottest_buckets\": [", stats.ops);
+        for (j = 0; j < hot; j++) {
+            printf("%s{\"bucket\": %d, \"ops\": %lu}", j ? ", " : "", top[j], stats.bucket_ops[top[j]]);
+        }
+        printf("]}");
+#else
+        printf("], \"ops\": null, \"hottest_buckets\": null}");
+#endif
+    } else {
+        if (first) {
+            printf("bench,threads,keys,load_factor,chain_stddev,longest_chain,longest_bucket,node_bytes,bucket_bytes,"
+                   "bytes_per_bucket,lock_bytes,histogram,ops,hottest_buckets\n");
+        }
+        printf("hash-stats,%d,%lld,%f,%f,%d,%d,%lu,%lu,%lu,%lu,", THREAD_COUNT, stats.keys, stats.load_factor,
+               stats.chain_stddev, stats.longest_chain, stats.longest_bucket, stats.node_bytes, stats.bucket_bytes,
+               per_bucket, stats.lock_bytes);
+        for (i = 0; i < HASH_HIST_SIZE; i++) { // the last entry counts all longer chains
+            printf("%s%d", i ? ";" : "", stats.histogram[i]);
+        }
+#if defined(LIST_STATS)
+        printf(",%llu,", stats.ops);
+        for (j = 0; j < hot; j++) { // bucket:operations
+            printf("%s%d:%lu", j ? ";" : "", top[j], stats.bucket_ops[top[j]]);
+        }
+        printf("\n");
+#else
+        printf(",,\n");
+#endif
+    }
+    hash_stats_free(&stats);
+    hash_teardown();
+    return 0;
+}
 
-    //printf("Hash runtime:\n");
-    printf("%f, ", endTimer());
+/**
+ * Key patterns for the hash skew benchmark
+ * strided keys are multiples of 64, clustered keys come in runs of 64 at far apart bases,
+ * adversarial keys only differ in the high bits, which defeats any masking of the low bits
+ */
+unsigned int skew_key(int pattern, int i) {
+    switch (pattern) {
+        case 0:
+            return (unsigned)i;
+        case 1:
+            return (unsigned)i * 64;
+        case 2:
+            return (unsigned)(i / 64) * 65536 * 7 + (unsigned)(i % 64);
+        default:
+            return (unsigned)i << 20;
+    }
 }
 
-void fairness_execution() {
+/**
+ * Report how evenly every hash function spreads every key pattern, one row per pattern and function
+ * @param json Whether to print JSON
+ * @param first Whether this is the first row, which prints the CSV header or no JSON separator
+ * @return 0 on success, -1 if a hash table could not be initialized
+ */
+int hash_skew(int json, int first) {
+    int pattern, func, i;
+    int n = HASH_SIZE * 4;
+    char* patterns[] = {"sequential", "strided", "clustered", "adversarial"};
+    hash_stats_t stats;
+
+    if (!json && first) {
+        printf("bench,pattern,function,buckets,load_factor,chain_stddev,longest_chain,empty_buckets,time_ms\n");
+    }
+    for (pattern = 0; pattern < 4; pattern++) {
+        for (func = 0; func < HASH_FUNC_COUNT; func++) {
+            if (hash_init_func(&hash, HASH_SIZE, (hash_func_t)func) < 0) {
+                return -1;
+            }
+            startTimer();
+            for (i = 0; i < n; i++) {
+                hash_insert(&hash, skew_key(pattern, i));
+            }
+            for (i = 0; i < n; i++) {
+                hash_lookup(&hash, skew_key(pattern, i));
+            }
+            double elapsed = endTimer();
+            hash_stats(&hash, &stats);
+            if (json) {
+                printf("%s  {\"bench\": \"hash-skew\", \"pattern\": \"%s\", \"function\": \"%s\", \"buckets\": %d, "
+                       "\"load_factor\": %f, \"chain_stddev\": %f, \"longest_chain\": %d, \"empty_buckets\": %d, "
+                       "\"time_ms\": %f}", first ? "" : ",\n", patterns[pattern], hash_func_names[func],
+                       stats.bucket_size, stats.load_factor, stats.chain_stddev, stats.longest_chain,
+                       stats.histogram[0], elapsed);
+            } else {
+                printf("hash-skew,%s,%s,%d,%f,%f,%d,%d,%f\n", patterns[pattern], hash_func_names[func],
+                       stats.bucket_size, stats.load_factor, stats.chain_stddev, stats.longest_chain,
+                       stats.histogram[0], elapsed);
+            }
+            first = 0;
+            hash_stats_free(&stats);
+            hash_destroy(&hash);
+        }
+    }
+    return 0;
+}
+
+/**
+ * A benchmark either times a worker over THREAD_COUNT threads (setup and teardown run outside the timer),
+ * or is a report that prints its own rows in the selected format
+ */
+typedef struct {
+    const char *name;            /**< the name used by --bench */
+    const char *description;     /**< one line shown by --help */
+    void (*setup)(void);         /**< prepare the shared structure, may be NULL */
+    void *(*worker)(void *);     /**< the thread function to be timed */
+    void (*teardown)(void);      /**< release the shared structure, may be NULL */
+    int ops_factor;              /**< operations per thread in units of MAX_N */
+    int fairness;                /**< whether workers record per-thread times in timeTotal */
+    int (*report)(int, int);     /**< run instead of timing for report benchmarks, called once per thread count
+                                      with the JSON flag and whether it prints the first row, returns -1 on failure */
+    int once;                    /**< the report does not depend on thread count */
+    const char *ops[OP_TYPES];   /**< names of the operation types the worker times, NULL if unused */
+} bench_t;
+
+bench_t benches[] = {
+        {"lock", "Lock performance", counter_setup, test_lock, NULL, 1, 0, NULL, 0, {NULL, "increment", NULL}},
+        {"counter", "Counter performance", counter_setup, test_counter, NULL, 1, 0, NULL, 0, {"get", "increment", "decrement"}},
+        {"list", "List performance", list_setup, test_list, list_teardown, 1, 0, NULL, 0, {"lookup", "insert", "delete"}},
+        {"list-order", "List insertion then deletion", list_setup, test_list_order, list_teardown, 2, 0, NULL, 0, {NULL, "insert", "delete"}},
+        {"hash", "Hash performance", hash_setup, test_hash, hash_teardown, 1, 0, NULL, 0, {"lookup", "insert", "delete"}},
+        {"hash-kv", "Type-specialized key-value hash, values copied out by lookups", kvhash_setup, test_hash_kv, kvhash_teardown, 1, 0, NULL, 0, {"get", "put", "delete"}},
+        {"dhash", "Delegated hash, shards owned by server threads", dhash_setup, test_dhash, dhash_teardown, 1, 0, NULL, 0, {"lookup", "insert", "delete"}},
+        {"hash-order", "Hash insertion then deletion", hash_setup, test_hash_order, hash_teardown, 2, 0, NULL, 0, {NULL, "insert", "delete"}},
+        {"fairness-exec", "Fairness (execution)", counter_setup, test_exec, NULL, 1, 1, NULL, 0, {NULL, "increment", NULL}},
+        {"fairness-reacquire", "Fairness (reacquire)", counter_setup, test_acquire, NULL, 1, 1, NULL, 0, {NULL, "increment", NULL}},
+        {"queue-ring", "Bounded MPMC ring, producers and consumers", ring_setup, test_ring, ring_teardown, 1, 0, NULL, 0, {"dequeue", "enqueue", NULL}},
+        {"queue-ms", "Two-lock queue, producers and consumers", msqueue_setup, test_msqueue, msqueue_teardown, 1, 0, NULL, 0, {"dequeue", "enqueue", NULL}},
+        {"hash-stats", "Hash statistics", NULL, NULL, NULL, 0, 0, hash_statistics, 0, {NULL, NULL, NULL}},
+        {"hash-skew", "Hash skew", NULL, NULL, NULL, 0, 0, hash_skew, 1, {NULL, NULL, NULL}},
+};
+#define BENCH_COUNT (int)(sizeof(benches) / sizeof(bench_t))
+
+/**
+ * Calculate the mean and the sample standard deviation of n values
+ */
+void mean_stddev(double *values, int n, double *mean, double *stddev) {
     int i;
-    counter_init(&counter, 0);
-    pthread_t* threads = malloc(sizeof(pthread_t)*THREAD_COUNT);
-    for (i = 0; i < THREAD_COUNT; i++) {
-        pthread_create(&threads[i], NULL, test_exec, (void *)(unsigned long) i);
+    double sum = 0, square = 0;
+    for (i = 0; i < n; i++) {
+        sum += values[i];
     }
-    for (i = 0; i < THREAD_COUNT; i++) {
-        pthread_join(threads[i], NULL);
+    *mean = sum / n;
+    for (i = 0; i < n; i++) {
+        square += (values[i] - *mean) * (values[i] - *mean);
     }
+    *stddev = n > 1 ? sqrt(square / (n - 1)) : 0;
+}
 
-    //printf("Average execution time:\n");
-    printf("np.array([");
-    for (i = 0; i < THREAD_COUNT; i++) {
-        printf("%f, ", 1.0 * timeTotal[i]);
+/**
+ * Print the CSV header columns of latency percentiles for every operation type of the benchmark
+ */
+void latency_header(bench_t *bench) {
+    int op;
+    for (op = 0; op < OP_TYPES; op++) {
+        const char *name = bench->ops[op];
+        if (name != NULL) {
+            printf(",%s_count,%s_mean_ns,%s_p50_ns,%s_p90_ns,%s_p99_ns,%s_p999_ns,%s_max_ns",
+                   name, name, name, name, name, name, name);
+        }
     }
-    printf("\b\b]).var(),\n");
 }
 
-void fairness_reacquire() {
+/**
+ * Print latency percentiles of every operation type of the benchmark, as CSV columns or a JSON field
+ * @param bench The benchmark
+ * @param merged OP_TYPES histograms merged over all threads and repetitions
+ * @param json Whether to print JSON
+ */
+void latency_report(bench_t *bench, latency_t *merged, int json) {
+    int op, first = 1;
+    if (json) {
+        printf(", \"latency\": {");
+    }
+    for (op = 0; op < OP_TYPES; op++) {
+        latency_t *l = &merged[op];
+        if (bench->ops[op] == NULL) {
+            continue;
+        }
+        double mean = l->total ? (double)l->sum / l->total : 0;
+        if (json) {
+            printf("%s\"%s\": {\"count\": %llu, \"mean_ns\": %f, \"p50_ns\": %llu, \"p90_ns\": %llu, "
+                   "\"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}",
+                   first ? "" : ", ", bench->ops[op], l->total, mean, latency_percentile(l, 50),
+                   latency_percentile(l, 90), latency_percentile(l, 99), latency_percentile(l, 99.9), l->max);
+        } else {
+            printf(",%llu,%f,%llu,%llu,%llu,%llu,%llu", l->total, mean, latency_percentile(l, 50),
+                   latency_percentile(l, 90), latency_percentile(l, 99), latency_percentile(l, 99.9), l->max);
+        }
+        first = 0;
+    }
+    if (json) {
+        printf("}");
+    }
+}
+
+/**
+ * Print hardware counter values per operation, as CSV columns or a JSON field
+ * Events that could not be counted are left empty (CSV) or null (JSON)
+ * @param counts The counts summed over all threads and repetitions
+ * @param ops The number of operations they cover
+ * @param json Whether to print JSON
+ */
+void perf_report(perf_counts_t *counts, double ops, int json) {
     int i;
-    counter_init(&counter, 0);
-    pthread_t* threads = malloc(sizeof(pthread_t)*THREAD_COUNT);
-    for (i = 0; i < THREAD_COUNT; i++) {
-        pthread_create(&threads[i], NULL, test_acquire, (void *)(unsigned long) i);
+    if (json) {
+        printf(", \"perf_per_op\": {");
     }
-    for (i = 0; i < THREAD_COUNT; i++) {
-        pthread_join(threads[i], NULL);
+    for (i = 0; i < PERF_EVENTS; i++) {
+        if (json) {
+            printf("%s\"%s\": ", i ? ", " : "", perf_event_names[i]);
+        } else {
+            printf(",");
+        }
+        if (counts->valid[i] && ops > 0) {
+            printf("%f", counts->value[i] / ops);
+        } else if (json) {
+            printf("null");
+        }
+    }
+    if (json) {
+        printf("}");
     }
+}
 
-    //printf("Average reacquire time:\n");
-    printf("cv(np.array([");
-    for (i = 0; i < THREAD_COUNT; i++) {
-        printf("%f, ", timeTotal[i]);
+/**
+ * Parse a thread list like "1-8" or "1,2,4,8" or "2,4-6"
+ * @return The number of entries stored into counts, -1 if the list is malformed
+ */
+int parse_threads(const char *text, int *counts, int max) {
+    int n = 0;
+    const char *p = text;
+    while (*p) {
+        char *end;
+        long lo = strtol(p, &end, 10), hi = lo;
+        if (end == p || lo < 1 || lo > MAX_THREADS) {
+            return -1;
+        }
+        p = end;
+        if (*p == '-') {
+            hi = strtol(p + 1, &end, 10);
+            if (end == p + 1 || hi < lo || hi > MAX_THREADS) {
+                return -1;
+            }
+            p = end;
+        }
+        for (; lo <= hi; lo++) {
+            if (n == max) {
+                return -1;
+            }
+            counts[n++] = (int)lo;
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p) {
+            return -1;
+        }
     }
-    printf("\b\b])),\n");
+    return n;
 }
 
-// TODO: hash scaling, hash/list insertion/insertion&delete (serial/random)
-int main() {
-    int n = 6;
-    char* notice[] = {
-            "Lock performance",
-            "Counter performance",
-            "List performance",
-            "Hash performance",
-            "Fairness (execution)",
-            "Fairness (reacquire)"
-    };
-    printf("Test options:\n");
-    for (int i = 0; i < n; i++) {
-        printf("%s\t%d\n", notice[i], i);
+void usage(const char *prog) {
+    int i;
+    printf("Usage: %s --bench NAME [options]\n", prog);
+    printf("  -b, --bench NAME       benchmark to run, one of:\n");
+    for (i = 0; i < BENCH_COUNT; i++) {
+        printf("                           %-20s %s\n", benches[i].name, benches[i].description);
     }
+    printf("  -t, --threads LIST     thread counts, e.g. 1-8 or 1,2,4,8 (default 1-8)\n");
+    printf("  -O, --oversubscribe    thread counts of 1x to %dx the online CPUs instead of --threads\n", OVERSUBSCRIBE_MAX);
+    printf("  -n, --ops N            operations per thread (default %d)\n", MAX_N);
+    printf("  -r, --read PCT         percentage of lookups (default %d)\n", READ_RATE);
+    printf("  -i, --insert PCT       percentage of inserts, the rest are deletes (default %d)\n", INSERT_RATE);
+    printf("  -u, --unique           list and hash inserts skip keys that are already present\n");
+    printf("  -k, --range N          keys are drawn from [0, N) (default %d)\n", RANGE);
+    printf("  -d, --dist NAME        key distribution: uniform, zipf, hotspot, sequential or latest (default uniform)\n");
+    printf("      --theta X          zipfian skew for zipf and latest, greater than 0 (default %.2f)\n", ZIPF_THETA);
+    printf("      --hot-keys PCT     percentage of hot keys for hotspot (default %d)\n", (int)(HOT_KEYS * 100));
+    printf("      --hot-ops PCT      percentage of accesses to hot keys for hotspot (default %d)\n", (int)(HOT_OPS * 100));
+    printf("  -s, --buckets N        hash bucket count (default %d)\n", HASH_SIZE);
+    printf("  -H, --hash-func NAME   mod, fibonacci, murmur or xxhash (default mod)\n");
+    printf("      --shards N         server threads of the dhash benchmark (default %d)\n", SHARDS);
+    printf("      --inflight N       requests a dhash client keeps in flight (default %d)\n", INFLIGHT);
+    printf("      --completion MODE  poll or wait for dhash completions (default poll)\n");
+    printf("      --producers N      producer threads of the queue benchmarks, the rest consume (default half)\n");
+    printf("      --capacity N       capacity of the queue-ring benchmark (default %d)\n", QUEUE_CAPACITY);
+    printf("  -D, --duration MS      run every thread count for a fixed time instead of --ops per thread\n");
+    printf("  -w, --warmup MS        warm-up time before measuring, duration mode only (default 0)\n");
+    printf("  -I, --interval MS      throughput sampling interval, duration mode only (default %d)\n", INTERVAL_MS);
+    printf("  -p, --pin POLICY       thread placement: none, compact, cores or scatter (default none)\n");
+    printf("  -R, --reps N           repetitions per thread count (default 1)\n");
+    printf("  -S, --seed N           random seed (default %u)\n", SEED);
+    printf("  -l, --latency          record per-operation latency and report percentiles\n");
+    printf("  -P, --perf             count cycles, instructions, LLC and branch misses, context switches\n"
+           "                         and CPU migrations with perf_event_open, reported per operation\n");
+    printf("      --replay FILE      replay a recorded trace against the structure of --bench instead of its workload\n");
+    printf("      --replay-timing T  fast (as fast as possible) or original (keep recorded timing) (default fast)\n");
+    printf("      --record FILE      record the operations of one run into a trace, needs the P4-trace build\n");
+    printf("  -f, --format FMT       csv or json (default csv)\n");
+    printf("  -h, --help             show this message\n");
+}
 
-    int op;
-    scanf("%d", &op);
+int main(int argc, char *argv[]) {
+    int i, t, r;
+    int reps = 1, json = 0, thread_n = 8;
+    int thread_counts[MAX_THREADS] = {1, 2, 3, 4, 5, 6, 7, 8};
+    bench_t *bench = NULL;
+    struct option options[] = {
+            {"bench", required_argument, NULL, 'b'},
+            {"threads", required_argument, NULL, 't'},
+            {"oversubscribe", no_argument, NULL, 'O'},
+            {"ops", required_argument, NULL, 'n'},
+            {"read", required_argument, NULL, 'r'},
+            {"insert", required_argument, NULL, 'i'},
+            {"unique", no_argument, NULL, 'u'},
+            {"range", required_argument, NULL, 'k'},
+            {"dist", required_argument, NULL, 'd'},
+            {"theta", required_argument, NULL, 1000},
+            {"hot-keys", required_argument, NULL, 1001},
+            {"hot-ops", required_argument, NULL, 1002},
+            {"buckets", required_argument, NULL, 's'},
+            {"hash-func", required_argument, NULL, 'H'},
+            {"shards", required_argument, NULL, 1008},
+            {"inflight", required_argument, NULL, 1009},
+            {"completion", required_argument, NULL, 1010},
+            {"producers", required_argument, NULL, 1006},
+            {"capacity", required_argument, NULL, 1007},
+            {"duration", required_argument, NULL, 'D'},
+            {"warmup", required_argument, NULL, 'w'},
+            {"interval", required_argument, NULL, 'I'},
+            {"pin", required_argument, NULL, 'p'},
+            {"reps", required_argument, NULL, 'R'},
+            {"seed", required_argument, NULL, 'S'},
+            {"latency", no_argument, NULL, 'l'},
+            {"perf", no_argument, NULL, 'P'},
+            {"replay", required_argument, NULL, 1003},
+            {"replay-timing", required_argument, NULL, 1004},
+            {"record", required_argument, NULL, 1005},
+            {"format", required_argument, NULL, 'f'},
+            {"help", no_argument, NULL, 'h'},
+            {NULL, 0, NULL, 0}
+    };
 
-    for (THREAD_COUNT = 1; THREAD_COUNT <= 8; THREAD_COUNT++) {
-        //printf("threads: %d, n: %d\n", THREAD_COUNT, MAX_N);
-        switch (op) {
-            case 0:
-                lock_performance();
+    int opt;
+    while ((opt = getopt_long(argc, argv, "b:t:On:r:i:uk:d:s:H:D:w:I:p:R:S:lPf:h", options, NULL)) != -1) {
+        switch (opt) {
+            case 'b':
+                for (i = 0; i < BENCH_COUNT; i++) {
+                    if (strcmp(optarg, benches[i].name) == 0) {
+                        bench = &benches[i];
+                    }
+                }
+                if (bench == NULL) {
+                    fprintf(stderr, "No such benchmark: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                thread_n = parse_threads(optarg, thread_counts, MAX_THREADS);
+                if (thread_n <= 0) {
+                    fprintf(stderr, "Bad thread list: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'n':
+                MAX_N = atoi(optarg);
+                break;
+            case 'r':
+                READ_RATE = atoi(optarg);
+                break;
+            case 'i':
+                INSERT_RATE = atoi(optarg);
+                break;
+            case 'u':
+                UNIQUE = 1;
+                break;
+            case 'k':
+                RANGE = atoi(optarg);
+                break;
+            case 'd':
+                for (i = 0; i < DIST_COUNT && strcmp(optarg, dist_names[i]) != 0; i++);
+                if (i == DIST_COUNT) {
+                    fprintf(stderr, "No such key distribution: %s\n", optarg);
+                    return 1;
+                }
+                KEY_DIST_TYPE = (dist_type_t)i;
+                break;
+            case 1000:
+                ZIPF_THETA = atof(optarg);
+                break;
+            case 1001:
+                HOT_KEYS = atoi(optarg) / 100.0;
+                break;
+            case 1002:
+                HOT_OPS = atoi(optarg) / 100.0;
+                break;
+            case 's':
+                HASH_SIZE = atoi(optarg);
+                break;
+            case 'H':
+                for (i = 0; i < HASH_FUNC_COUNT && strcmp(optarg, hash_func_names[i]) != 0; i++);
+                if (i == HASH_FUNC_COUNT) {
+                    fprintf(stderr, "No such hash function: %s\n", optarg);
+                    return 1;
+                }
+                HASH_FUNC = (hash_func_t)i;
+                break;
+            case 'O': {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                if (cpus < 1) {
+                    cpus = 1;
+                }
+                for (thread_n = 0; thread_n < OVERSUBSCRIBE_MAX && cpus * (thread_n + 1) <= MAX_THREADS; thread_n++) {
+                    thread_counts[thread_n] = (int)cpus * (thread_n + 1);
+                }
+                break;
+            }
+            case 1008:
+                SHARDS = atoi(optarg);
+                break;
+            case 1009:
+                INFLIGHT = atoi(optarg);
+                break;
+            case 1010:
+                if (strcmp(optarg, "wait") == 0) {
+                    COMPLETION_WAIT = 1;
+                } else if (strcmp(optarg, "poll") != 0) {
+                    fprintf(stderr, "No such completion mode: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 1006:
+                PRODUCERS = atoi(optarg);
+                break;
+            case 1007:
+                QUEUE_CAPACITY = atoi(optarg);
+                break;
+            case 'D':
+                DURATION_MS = atoi(optarg);
+                break;
+            case 'w':
+                WARMUP_MS = atoi(optarg);
+                break;
+            case 'I':
+                INTERVAL_MS = atoi(optarg);
+                break;
+            case 'p':
+                for (i = 0; i < PLACE_COUNT && strcmp(optarg, placement_names[i]) != 0; i++);
+                if (i == PLACE_COUNT) {
+                    fprintf(stderr, "No such placement policy: %s\n", optarg);
+                    return 1;
+                }
+                PLACEMENT = (placement_t)i;
+                break;
+            case 'R':
+                reps = atoi(optarg);
+                break;
+            case 'S':
+                SEED = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                LATENCY_ON = 1;
                 break;
-            case 1:
-                counter_performance();
+            case 'P':
+                PERF_ON = 1;
                 break;
-            case 2:
-                list_performance();
+            case 1003:
+                REPLAY_PATH = optarg;
                 break;
-            case 3:
-                hash_performance();
+            case 1004:
+                if (strcmp(optarg, "original") == 0) {
+                    REPLAY_ORIGINAL = 1;
+                } else if (strcmp(optarg, "fast") != 0) {
+                    fprintf(stderr, "No such replay timing: %s\n", optarg);
+                    return 1;
+                }
                 break;
-            case 4:
-                fairness_execution();
+            case 1005:
+#ifdef P4_TRACE
+                RECORD_PATH = optarg;
                 break;
-            case 5:
-                fairness_reacquire();
+#else
+                fprintf(stderr, "Recording needs the instrumented build, run make P4-trace\n");
+                return 1;
+#endif
+            case 'f':
+                if (strcmp(optarg, "json") == 0) {
+                    json = 1;
+                } else if (strcmp(optarg, "csv") != 0) {
+                    fprintf(stderr, "No such format: %s\n", optarg);
+                    return 1;
+                }
                 break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
             default:
-                printf("No such option!");
+                usage(argv[0]);
+                return 1;
         }
     }
-    return 0;
-}
\ No newline at end of file
+    if (bench == NULL) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (MAX_N < 1 || RANGE < 1 || HASH_SIZE < 1 || reps < 1 || READ_RATE < 0 || INSERT_RATE < 0
+        || READ_RATE + INSERT_RATE > 100
+        || HOT_KEYS < 0 || HOT_KEYS > 1 || HOT_OPS < 0 || HOT_OPS > 1
+        || SHARDS < 1 || SHARDS > MAX_THREADS || INFLIGHT < 1 || PRODUCERS < 0 || QUEUE_CAPACITY < 1 || DURATION_MS < 0 || WARMUP_MS < 0 || INTERVAL_MS < 1) {
+        fprintf(stderr, "Bad workload parameters\n");
+        return 1;
+    }
+    if (!(ZIPF_THETA > 0)) { // also rejects NaN
+        fprintf(stderr, "--theta must be greater than 0, got %g\n", ZIPF_THETA);
+        return 1;
+    }
+    if (PERF_ON) {
+        perf_t probe;
+        if (perf_open(&probe) == 0) {
+            fprintf(stderr, "perf events are not permitted (see /proc/sys/kernel/perf_event_paranoid), "
+                            "counters will be reported empty\n");
+        }
+        perf_close(&probe);
+    }
+    if (PLACEMENT != PLACE_NONE) {
+        PLACE_CPU_COUNT = topology_order(PLACEMENT, PLACE_CPUS, MAX_THREADS);
+    }
+    keydist_init(&KEY_DIST, KEY_DIST_TYPE, (unsigned)RANGE, ZIPF_THETA, HOT_KEYS, HOT_OPS);
+
+    if (DURATION_MS > 0 && (bench->ops_factor > 1 || bench->worker == test_ring || bench->worker == test_msqueue)) {
+        fprintf(stderr, "%s runs a fixed number of operations, duration mode is not supported\n", bench->name);
+        return 1;
+    }
+#ifdef P4_TRACE
+    if (RECORD_PATH != NULL && (thread_n != 1 || reps != 1 || bench->report != NULL || REPLAY_PATH != NULL)) {
+        fprintf(stderr, "Recording needs a single workload run, use one thread count and one repetition\n");
+        return 1;
+    }
+#endif
+    void *(*worker)(void *) = bench->worker;
+    if (REPLAY_PATH != NULL) {
+        if (bench->setup == counter_setup) {
+            REPLAY_OP = replay_counter;
+        } else if (bench->setup == list_setup) {
+            REPLAY_OP = replay_list;
+        } else if (bench->setup == hash_setup) {
+            REPLAY_OP = replay_hash;
+        }
+        if (REPLAY_OP == NULL || DURATION_MS > 0) {
+            fprintf(stderr, "Replay needs a counter, list or hash benchmark in fixed-operation mode\n");
+            return 1;
+        }
+        if (trace_open(&TRACE, REPLAY_PATH) < 0) {
+            return 1;
+        }
+        worker = test_replay;
+    }
+    if (bench->report != NULL) { // reports print rows of their own columns, JSON rows go into one array
+        if (json) {
+            printf("[\n");
+        }
+        for (t = 0; t < (bench->once ? 1 : thread_n); t++) {
+            THREAD_COUNT = thread_counts[t];
+            if (bench->report(json, t == 0) < 0) {
+                return 1;
+            }
+        }
+        if (json) {
+            printf("\n]\n");
+        }
+        return 0;
+    }
+
+    int fairness = bench->fairness || DURATION_MS > 0;
+    double *elapsed = malloc(sizeof(double) * reps);
+    double *done = malloc(sizeof(double) * reps);
+    double *spread = malloc(sizeof(double) * reps);
+    latency_t *merged = malloc(sizeof(latency_t) * OP_TYPES);
+    if (LATENCY_ON) {
+        LATENCY = malloc(sizeof(latency_t) * OP_TYPES * MAX_THREADS);
+    }
+    SERIES_N = DURATION_MS > 0 ? (DURATION_MS + INTERVAL_MS - 1) / INTERVAL_MS : 0;
+    SERIES = malloc(sizeof(double) * (SERIES_N + 1));
+    double *series = malloc(sizeof(double) * (SERIES_N + 1));
+    if (json) {
+        printf("[\n");
+    } else {
+        printf("bench,threads,ops,reps,mean_ms,stddev_ms,ops_per_sec%s", fairness ? ",fairness_cv" : "");
+        if (LATENCY_ON) {
+            latency_header(bench);
+        }
+        for (i = 0; PERF_ON && i < PERF_EVENTS; i++) {
+            printf(",%s_per_op", perf_event_names[i]);
+        }
+        printf("%s\n", DURATION_MS > 0 ? ",series_ops_per_sec" : "");
+    }
+    for (t = 0; t < thread_n; t++) {
+        THREAD_COUNT = thread_counts[t];
+        for (i = 0; i < OP_TYPES; i++) {
+            latency_init(&merged[i]);
+        }
+        for (i = 0; i < SERIES_N; i++) {
+            series[i] = 0;
+        }
+        memset(&PERF_COUNTS, 0, sizeof(PERF_COUNTS));
+        if (REPLAY_PATH != NULL && trace_partition(&TRACE, THREAD_COUNT, REPLAY_PARTS) < 0) {
+            return 1;
+        }
+        for (r = 0; r < reps; r++) {
+            if (bench->setup != NULL) {
+                bench->setup();
+            }
+            for (i = 0; LATENCY_ON && i < THREAD_COUNT * OP_TYPES; i++) {
+                latency_init(&LATENCY[i]);
+            }
+            elapsed[r] = run_threads(worker);
+            for (i = 0; LATENCY_ON && i < THREAD_COUNT * OP_TYPES; i++) {
+                latency_merge(&merged[i % OP_TYPES], &LATENCY[i]);
+            }
+#ifdef P4_TRACE
+            if (RECORD_PATH != NULL) {
+                trace_write(RECORD_PATH, TRACE_BUF, THREAD_COUNT);
+                for (i = 0; i < THREAD_COUNT; i++) {
+                    trace_buffer_free(&TRACE_BUF[i]);
+                }
+            }
+#endif
+            if (bench->teardown != NULL) {
+                bench->teardown();
+            }
+
+            double mean, stddev;
+            if (DURATION_MS > 0) { // fairness is the coefficient of variation of per-thread operations
+                double per_thread[MAX_THREADS];
+                done[r] = 0;
+                for (i = 0; i < THREAD_COUNT; i++) {
+                    per_thread[i] = (double)MEASURED[i];
+                    done[r] += per_thread[i];
+                }
+                mean_stddev(per_thread, THREAD_COUNT, &mean, &stddev);
+                spread[r] = mean > 0 ? stddev / mean : 0;
+                for (i = 0; i < SERIES_N; i++) {
+                    series[i] += SERIES[i] / reps;
+                }
+            } else if (REPLAY_PATH != NULL) {
+                done[r] = (double)TRACE.header->count;
+            } else {
+                done[r] = (double)MAX_N * bench->ops_factor * THREAD_COUNT;
+                if (bench->fairness) { // coefficient of variation of per-thread times
+                    mean_stddev(timeTotal, THREAD_COUNT, &mean, &stddev);
+                    spread[r] = mean > 0 ? stddev / mean : 0;
+                }
+            }
+        }
+        if (REPLAY_PATH != NULL) {
+            trace_partition_free(REPLAY_PARTS, THREAD_COUNT);
+        }
+
+        double mean, stddev, cv = 0, cv_stddev, mean_ops, ops_stddev;
+        mean_stddev(elapsed, reps, &mean, &stddev);
+        mean_stddev(done, reps, &mean_ops, &ops_stddev);
+        long long ops = (long long)(mean_ops + 0.5);
+        if (fairness) {
+            mean_stddev(spread, reps, &cv, &cv_stddev);
+        }
+        double throughput = mean > 0 ? mean_ops / (mean / 1000) : 0;
+        if (json) {
+            printf("  {\"bench\": \"%s\", \"threads\": %d, \"ops\": %lld, \"reps\": %d, "
+                   "\"mean_ms\": %f, \"stddev_ms\": %f, \"ops_per_sec\": %f",
+                   bench->name, THREAD_COUNT, ops, reps, mean, stddev, throughput);
+            if (fairness) {
+                printf(", \"fairness_cv\": %f", cv);
+            }
+            if (LATENCY_ON) {
+                latency_report(bench, merged, json);
+            }
+            if (PERF_ON) {
+                perf_report(&PERF_COUNTS, mean_ops * reps, json);
+            }
+            if (DURATION_MS > 0) {
+                printf(", \"series_ops_per_sec\": [");
+                for (i = 0; i < SERIES_N; i++) {
+                    printf("%s%f", i ? ", " : "", series[i]);
+                }
+                printf("]");
+            }
+            printf("}%s\n", t + 1 < thread_n ? "," : "");
+        } else {
+            printf("%s,%d,%lld,%d,%f,%f,%f", bench->name, THREAD_COUNT, ops, reps, mean, stddev, throughput);
+            if (fairness) {
+                printf(",%f", cv);
+            }
+            if (LATENCY_ON) {
+                latency_report(bench, merged, json);
+            }
+            if (PERF_ON) {
+                perf_report(&PERF_COUNTS, mean_ops * reps, json);
+            }
+            if (DURATION_MS > 0) { // one column, intervals separated by semicolons
+                printf(",");
+                for (i = 0; i < SERIES_N; i++) {
+                    printf("%s%f", i ? ";" : "", series[i]);
+                }
+            }
+            printf("\n");
+        }
+    }
+    if (json) {
+        printf("]\n");
+    }
+
+    if (REPLAY_PATH != NULL) {
+        trace_close(&TRACE);
+    }
+    free(series);
+    free(SERIES);
+    free(LATENCY);
+    free(merged);
+    free(spread);
+    free(done);
+    free(elapsed);
+    return CHECK_FAILED ? 1 : 0;
+}
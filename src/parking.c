@@ -0,0 +1,328 @@
+#include "parking.h"
+#include "lock.h"
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * The number of wait queues in the table
+ */
+#define PARKING_BITS 8
+#define PARKING_BUCKETS (1 << PARKING_BITS)
+
+/**
+ * A queue is unparked fairly, handing the lock over, at least once every PARKING_FAIR_NS
+ */
+#define PARKING_FAIR_NS 500000LL
+
+/**
+ * Spin rounds of parklock_acquire_slow before it parks
+ */
+#define PARKLOCK_SPIN 64
+
+/**
+ * A parked thread, lives on the stack of the thread while it sleeps
+ */
+typedef struct _parking_node_t {
+    const void *addr;              /**< the address the thread parks on */
+    struct _parking_node_t *next;  /**< the next parked thread in the bucket */
+    unsigned long token;           /**< set by the unparker before waking the thread */
+    unsigned state;                /**< futex word, 0 while parked, 1 once unparked */
+} parking_node_t;
+
+/**
+ * A wait queue, shared by all addresses hashing to it, in parking order
+ */
+typedef struct {
+    spinlock_t lock;            /**< protects the queue, only held for a few pointer updates */
+    parking_node_t *head;       /**< the longest parked thread */
+    parking_node_t *tail;       /**< the last parked thread */
+    long long fair_deadline;    /**< when the next unpark of this bucket has to be fair */
+} __attribute__((aligned(64))) parking_bucket_t;
+
+static parking_bucket_t parking_table[PARKING_BUCKETS];
+
+static inline long long parking_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Select the bucket of an address with a Fibonacci hash
+ */
+static inline parking_bucket_t *parking_bucket(const void *addr) {
+    return &parking_table[((unsigned long)addr * 11400714819323198485UL) >> (64 - PARKING_BITS)];
+}
+
+/**
+ * Whether any thread in the bucket other than the removed ones parks on addr, the bucket lock must be held
+ */
+static inline int parking_more(parking_bucket_t *bucket, const void *addr) {
+    parking_node_t *cur;
+    for (cur = bucket->head; cur != NULL; cur = cur->next) {
+        if (cur->addr == addr) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Unlink node from the bucket, the bucket lock must be held
+ * @return 1 if the node was queued, 0 if it had already been removed
+ */
+static int parking_remove(parking_bucket_t *bucket, parking_node_t *node) {
+    parking_node_t *cur = bucket->head, *pre = NULL;
+    while (cur != NULL && cur != node) {
+        pre = cur;
+        cur = cur->next;
+    }
+    if (cur == NULL) {
+        return 0;
+    }
+    if (pre != NULL) {
+        pre->next = cur->next;
+    } else {
+        bucket->head = cur->next;
+    }
+    if (bucket->tail == cur) {
+        bucket->tail = pre;
+    }
+    return 1;
+}
+
+/**
+ * Sleep on the futex word of a parked node until it is unparked
+ */
+static void parking_sleep(parking_node_t *node) {
+    while (__atomic_load_n(&node->state, __ATOMIC_ACQUIRE) == 0) {
+        futex_wait(&node->state, 0);
+    }
+}
+
+/**
+ * Park the calling thread on addr
+ * validate runs with the queue locked, so a thread that changes the state checked by validate
+ * and then unparks cannot miss this thread
+ * @param addr The address to park on, usually the lock word
+ * @param validate Return 0 to not park after all, may be NULL
+ * @param timed_out Called with the queue locked when the timeout expires, more tells whether other threads are still
+ *                  parked on addr, may be NULL
+ * @param arg Passed to validate and timed_out
+ * @param timeout_ns The longest time to sleep in ns, negative to sleep until unparked
+ * @param token Output of the token given by the unparker, may be NULL
+ * @return PARKING_INVALID, PARKING_UNPARKED or PARKING_TIMEOUT
+ */
+int parking_park(const void *addr, int (*validate)(const void *addr, void *arg),
+                 void (*timed_out)(const void *addr, int more, void *arg), void *arg,
+                 long long timeout_ns, unsigned long *token) {
+    parking_bucket_t *bucket = parking_bucket(addr);
+    parking_node_t node = {addr, NULL, 0, 0};
+    long long deadline = timeout_ns >= 0 ? parking_now() + timeout_ns : 0;
+
+    spinlock_acquire(&bucket->lock);
+    if (validate != NULL && !validate(addr, arg)) {
+        spinlock_release(&bucket->lock);
+        return PARKING_INVALID;
+    }
+    if (bucket->tail != NULL) {
+        bucket->tail->next = &node;
+    } else {
+        bucket->head = &node;
+    }
+    bucket->tail = &node;
+    spinlock_release(&bucket->lock);
+
+    if (timeout_ns < 0) {
+        parking_sleep(&node);
+    } else {
+        while (__atomic_load_n(&node.state, __ATOMIC_ACQUIRE) == 0) {
+            long long remaining = deadline - parking_now();
+            if (remaining <= 0) {
+                break;
+            }
+            futex_wait_timed(&node.state, 0, remaining);
+        }
+        if (__atomic_load_n(&node.state, __ATOMIC_ACQUIRE) == 0) {
+            spinlock_acquire(&bucket->lock);
+            if (parking_remove(bucket, &node)) {
+                if (timed_out != NULL) {
+                    timed_out(addr, parking_more(bucket, addr), arg);
+                }
+                spinlock_release(&bucket->lock);
+                return PARKING_TIMEOUT;
+            }
+            spinlock_release(&bucket->lock);
+            parking_sleep(&node); // an unparker already took the node, it is about to wake us
+        }
+    }
+    if (token != NULL) {
+        *token = node.token;
+    }
+    return PARKING_UNPARKED;
+}
+
+/**
+ * Wake up the longest parked thread on addr
+ * callback runs with the queue locked, after the thread is dequeued but before it is woken, and returns the token
+ * the thread receives; it is told whether a thread was unparked, whether more are still parked on addr,
+ * and whether this unpark should be fair because the fairness timer of the queue expired
+ * @param addr The address threads park on
+ * @param callback Update the state of the lock and choose the token, may be NULL
+ * @param arg Passed to callback
+ * @return 1 if a thread was unparked, 0 if none was parked on addr
+ */
+int parking_unpark_one(const void *addr,
+                       unsigned long (*callback)(const void *addr, int unparked, int more, int fair, void *arg),
+                       void *arg) {
+    parking_bucket_t *bucket = parking_bucket(addr);
+    parking_node_t *node;
+    int fair = 0;
+    unsigned long token = 0;
+
+    spinlock_acquire(&bucket->lock);
+    for (node = bucket->head; node != NULL && node->addr != addr; node = node->next);
+    if (node != NULL) {
+        parking_remove(bucket, node);
+        long long now = parking_now();
+        if (now >= bucket->fair_deadline) {
+            fair = 1;
+            bucket->fair_deadline = now + PARKING_FAIR_NS;
+        }
+    }
+    if (callback != NULL) {
+        token = callback(addr, node != NULL, node != NULL && parking_more(bucket, addr), fair, arg);
+    }
+    if (node != NULL) {
+        node->token = token;
+    }
+    spinlock_release(&bucket->lock);
+
+    if (node == NULL) {
+        return 0;
+    }
+    __atomic_store_n(&node->state, 1, __ATOMIC_RELEASE);
+    futex_wake(&node->state, 1);
+    return 1;
+}
+
+/**
+ * Wake up all threads parked on addr, with token 0
+ * @param addr The address threads park on
+ * @return The number of threads unparked
+ */
+int parking_unpark_all(const void *addr) {
+    parking_bucket_t *bucket = parking_bucket(addr);
+    parking_node_t *cur, *next, *woken = NULL;
+    int n = 0;
+
+    spinlock_acquire(&bucket->lock);
+    for (cur = bucket->head; cur != NULL; cur = next) {
+        next = cur->next;
+        if (cur->addr == addr) {
+            parking_remove(bucket, cur);
+            cur->next = woken;
+            woken = cur;
+        }
+    }
+    spinlock_release(&bucket->lock);
+
+    for (cur = woken; cur != NULL; cur = next) {
+        next = cur->next; // read before waking, the node is gone once its thread runs
+        __atomic_store_n(&cur->state, 1, __ATOMIC_RELEASE);
+        futex_wake(&cur->state, 1);
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Only park while the lock is still held and marked as having parked threads
+ */
+static int parklock_validate(const void *addr, void *arg) {
+    return __atomic_load_n((parklock_t *)addr, __ATOMIC_RELAXED) == (PARKLOCK_LOCKED | PARKLOCK_PARKED);
+}
+
+/**
+ * The last thread to time out clears the parked bit
+ */
+static void parklock_timed_out(const void *addr, int more, void *arg) {
+    if (!more) {
+        __atomic_fetch_and((parklock_t *)addr, (unsigned char)~PARKLOCK_PARKED, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Slow path of parklock_acquire and parklock_acquire_timed, entered after the inline cmpxchg failed
+ * Spin while nobody is parked, then set the parked bit and park until the lock is released or handed over
+ * @param lock Pointer to the lock want to obtain
+ * @param timeout_ns The longest time to wait in ns, negative to wait forever
+ * @return 1 if the lock is acquired, 0 if the timeout expired
+ */
+int parklock_acquire_slow(parklock_t *lock, long long timeout_ns) {
+    int spin = 0;
+    unsigned long token;
+    long long deadline = timeout_ns >= 0 ? parking_now() + timeout_ns : 0;
+    unsigned char state = __atomic_load_n(lock, __ATOMIC_RELAXED);
+    for (;;) {
+        if (!(state & PARKLOCK_LOCKED)) { // keep the parked bit, others may still sleep
+            if (__atomic_compare_exchange_n(lock, &state, state | PARKLOCK_LOCKED, 1,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return 1;
+            }
+            continue;
+        }
+        if (!(state & PARKLOCK_PARKED) && spin < PARKLOCK_SPIN) {
+            spin++;
+            cpu_pause();
+            state = __atomic_load_n(lock, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (!(state & PARKLOCK_PARKED)) {
+            if (!__atomic_compare_exchange_n(lock, &state, state | PARKLOCK_PARKED, 1,
+                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                continue;
+            }
+        }
+        long long remaining = -1;
+        if (timeout_ns >= 0 && (remaining = deadline - parking_now()) < 0) {
+            remaining = 0;
+        }
+        int result = parking_park(lock, parklock_validate, parklock_timed_out, NULL, remaining, &token);
+        if (result == PARKING_UNPARKED && token == PARKING_HANDOFF) {
+            return 1;
+        }
+        if (result == PARKING_TIMEOUT) {
+            return 0;
+        }
+        spin = 0;
+        state = __atomic_load_n(lock, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Decide how the released lock goes on, with the queue of the lock still locked
+ * A fair unpark hands the lock over and keeps it locked, otherwise the lock is freed and the woken thread competes
+ */
+static unsigned long parklock_unparked(const void *addr, int unparked, int more, int fair, void *arg) {
+    parklock_t *lock = (parklock_t *)addr;
+    if (unparked && (fair || *(int *)arg)) {
+        __atomic_store_n(lock, more ? PARKLOCK_LOCKED | PARKLOCK_PARKED : PARKLOCK_LOCKED, __ATOMIC_RELAXED);
+        return PARKING_HANDOFF;
+    }
+    __atomic_store_n(lock, more ? PARKLOCK_PARKED : 0, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Slow path of parklock_release, entered when the parked bit is set
+ * @param lock Pointer to the lock want to release
+ * @param fair Whether to hand the lock over even if the fairness timer did not expire
+ */
+void parklock_release_slow(parklock_t *lock, int fair) {
+    unsigned char expected = PARKLOCK_LOCKED;
+    if (__atomic_compare_exchange_n(lock, &expected, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        return; // the last parked thread timed out meanwhile
+    }
+    parking_unpark_one(lock, parklock_unparked, &fair);
+}
@@ -0,0 +1,102 @@
+#ifndef P4_PARKING_H
+#define P4_PARKING_H
+
+/**
+ * A parking lot keeps the wait queues of all locks in one global hashed table,
+ * so a lock itself only needs a couple of bits to tell whether it is held and whether anybody sleeps on it
+ * Threads park on any address, the address is only used as the key of the queue and is never dereferenced
+ */
+
+/**
+ * The outcome of parking_park
+ */
+typedef enum {
+    PARKING_INVALID = 0, /**< validate refused, the thread did not sleep */
+    PARKING_UNPARKED,    /**< woken up by parking_unpark_one or parking_unpark_all */
+    PARKING_TIMEOUT      /**< the timeout expired before anybody woke the thread */
+} parking_result_t;
+
+/**
+ * Token passed by parking_unpark_one to the woken thread to say the lock was handed over to it
+ */
+#define PARKING_HANDOFF 1UL
+
+int parking_park(const void *addr, int (*validate)(const void *addr, void *arg),
+                 void (*timed_out)(const void *addr, int more, void *arg), void *arg,
+                 long long timeout_ns, unsigned long *token);
+int parking_unpark_one(const void *addr,
+                       unsigned long (*callback)(const void *addr, int unparked, int more, int fair, void *arg),
+                       void *arg);
+int parking_unpark_all(const void *addr);
+
+/**
+ * A one byte lock built on the parking lot
+ * Bit 0 tells whether the lock is held, bit 1 whether threads are parked on it, the other bits are unused
+ */
+typedef unsigned char parklock_t;
+
+#define PARKLOCK_LOCKED 1
+#define PARKLOCK_PARKED 2
+
+int parklock_acquire_slow(parklock_t *lock, long long timeout_ns);
+void parklock_release_slow(parklock_t *lock, int fair);
+
+/**
+ * Initialize a parking lock, should be called before use
+ * @param lock Pointer to the lock need to be initialized
+ */
+static inline void parklock_init(parklock_t *lock) {
+    *lock = 0;
+}
+
+/**
+ * Acquire the given parking lock
+ * An uncontended lock is taken with a single cmpxchg, otherwise spin a little then park in the slow path
+ * @param lock Pointer to the lock want to obtain
+ */
+static inline void parklock_acquire(parklock_t *lock) {
+    unsigned char expected = 0;
+    if (!__atomic_compare_exchange_n(lock, &expected, PARKLOCK_LOCKED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        parklock_acquire_slow(lock, -1);
+    }
+}
+
+/**
+ * Acquire the given parking lock, giving up after the timeout
+ * @param lock Pointer to the lock want to obtain
+ * @param timeout_ns The longest time to wait, in ns
+ * @return 1 if the lock is acquired, 0 if the timeout expired
+ */
+static inline int parklock_acquire_timed(parklock_t *lock, long long timeout_ns) {
+    unsigned char expected = 0;
+    if (__atomic_compare_exchange_n(lock, &expected, PARKLOCK_LOCKED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return 1;
+    }
+    return parklock_acquire_slow(lock, timeout_ns < 0 ? 0 : timeout_ns);
+}
+
+/**
+ * Release the given parking lock
+ * Without parked threads this is a single cmpxchg, otherwise one thread is woken up to compete for the lock,
+ * or gets the lock handed over directly when the fairness timer of its queue expired
+ * @param lock Pointer to the lock want to release
+ */
+static inline void parklock_release(parklock_t *lock) {
+    unsigned char expected = PARKLOCK_LOCKED;
+    if (!__atomic_compare_exchange_n(lock, &expected, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        parklock_release_slow(lock, 0);
+    }
+}
+
+/**
+ * Release the given parking lock, always handing it over to the longest parked thread if there is one
+ * @param lock Pointer to the lock want to release
+ */
+static inline void parklock_release_fair(parklock_t *lock) {
+    unsigned char expected = PARKLOCK_LOCKED;
+    if (!__atomic_compare_exchange_n(lock, &expected, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        parklock_release_slow(lock, 1);
+    }
+}
+
+#endif //P4_PARKING_H
@@ -0,0 +1,121 @@
+#include "perf.h"
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+const char *perf_event_names[PERF_EVENTS] = {
+        "cycles", "instructions", "llc_misses", "branch_misses", "context_switches", "cpu_migrations"
+};
+
+static const struct {
+    unsigned int type;
+    unsigned long long config;
+} perf_events[PERF_EVENTS] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS},
+};
+
+/**
+ * Open a counter for the calling thread on any CPU
+ * @param attr The event attributes
+ * @return The file descriptor, or -1 on failure
+ */
+static int sys_perf_event_open(struct perf_event_attr *attr) {
+    return (int)syscall(SYS_perf_event_open, attr, 0, -1, -1, 0);
+}
+
+/**
+ * Open all counters for the calling thread, disabled
+ * Kernel-side counting is dropped if perf_event_paranoid does not allow it,
+ * events that still can't be opened are skipped
+ * @param perf The counters to be opened
+ * @return The number of events opened, 0 if perf events are not permitted
+ */
+int perf_open(perf_t *perf) {
+    int i, n = 0;
+    for (i = 0; i < PERF_EVENTS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_events[i].type;
+        attr.config = perf_events[i].config;
+        attr.disabled = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        perf->fd[i] = sys_perf_event_open(&attr);
+        if (perf->fd[i] < 0) {
+            attr.exclude_kernel = 1;
+            perf->fd[i] = sys_perf_event_open(&attr);
+        }
+        n += perf->fd[i] >= 0;
+    }
+    return n;
+}
+
+/**
+ * Reset and start all opened counters, may be called from any thread
+ * @param perf The counters
+ */
+void perf_enable(perf_t *perf) {
+    int i;
+    for (i = 0; i < PERF_EVENTS; i++) {
+        if (perf->fd[i] >= 0) {
+            ioctl(perf->fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(perf->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+/**
+ * Stop all opened counters, may be called from any thread
+ * @param perf The counters
+ */
+void perf_disable(perf_t *perf) {
+    int i;
+    for (i = 0; i < PERF_EVENTS; i++) {
+        if (perf->fd[i] >= 0) {
+            ioctl(perf->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+}
+
+/**
+ * Add the values of all opened counters to counts
+ * Values are scaled by enabled / running time when the kernel had to multiplex the counter
+ * @param perf The counters
+ * @param counts The sums to be added to
+ */
+void perf_read(perf_t *perf, perf_counts_t *counts) {
+    int i;
+    for (i = 0; i < PERF_EVENTS; i++) {
+        unsigned long long data[3]; // value, time enabled, time running
+        if (perf->fd[i] < 0 || read(perf->fd[i], data, sizeof(data)) != sizeof(data)) {
+            continue;
+        }
+        if (data[2] > 0 && data[2] < data[1]) {
+            data[0] = (unsigned long long)((double)data[0] * data[1] / data[2]);
+        }
+        counts->value[i] += data[0];
+        counts->valid[i] = 1;
+    }
+}
+
+/**
+ * Close all opened counters
+ * @param perf The counters
+ */
+void perf_close(perf_t *perf) {
+    int i;
+    for (i = 0; i < PERF_EVENTS; i++) {
+        if (perf->fd[i] >= 0) {
+            close(perf->fd[i]);
+            perf->fd[i] = -1;
+        }
+    }
+}
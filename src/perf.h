@@ -0,0 +1,39 @@
+#ifndef P4_PERF_H
+#define P4_PERF_H
+
+/**
+ * The hardware and software events counted around a benchmark phase
+ */
+#define PERF_CYCLES 0
+#define PERF_INSTRUCTIONS 1
+#define PERF_LLC_MISSES 2
+#define PERF_BRANCH_MISSES 3
+#define PERF_CONTEXT_SWITCHES 4
+#define PERF_CPU_MIGRATIONS 5
+#define PERF_EVENTS 6
+
+extern const char *perf_event_names[PERF_EVENTS];
+
+/**
+ * The counters of one thread, each event has its own file descriptor so that
+ * an event the kernel refuses does not take the others down with it
+ */
+typedef struct {
+    int fd[PERF_EVENTS]; /**< the counter file descriptors, -1 if the event could not be opened */
+} perf_t;
+
+/**
+ * Counter values, summed over threads by perf_read
+ */
+typedef struct {
+    unsigned long long value[PERF_EVENTS]; /**< the counts, scaled up when the kernel multiplexed the counter */
+    int valid[PERF_EVENTS];                /**< whether the event was counted at all */
+} perf_counts_t;
+
+int perf_open(perf_t *perf);
+void perf_enable(perf_t *perf);
+void perf_disable(perf_t *perf);
+void perf_read(perf_t *perf, perf_counts_t *counts);
+void perf_close(perf_t *perf);
+
+#endif //P4_PERF_H
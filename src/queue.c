@@ -0,0 +1,235 @@
+#include "queue.h"
+#include <stdio.h>
+
+/**
+ * The number of failed attempts a blocking ring operation spins before it sleeps
+ */
+#define RING_SPIN 128
+
+/**
+ * Initialize the given ring
+ * @param q A pointer to a ring
+ * @param capacity The number of items the ring can hold, rounded up to a power of two (at least 2)
+ * @return 0 on success, -1 if the cells cannot be allocated
+ */
+int ring_init(ring_t *q, unsigned int capacity) {
+    unsigned long i, size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    q->cells = malloc(sizeof(ring_cell_t) * size);
+    if (q->cells == NULL) {
+        perror("ring cells allocation failed!");
+        return -1;
+    }
+    for (i = 0; i < size; i++) {
+        q->cells[i].seq = i;
+        q->cells[i].value = NULL;
+    }
+    q->mask = size - 1;
+    q->head = 0;
+    q->tail = 0;
+    q->not_full = 0;
+    q->full_waiters = 0;
+    q->not_empty = 0;
+    q->empty_waiters = 0;
+    return 0;
+}
+
+/**
+ * Wake up one thread sleeping on a futex word of the ring, if there is any
+ * The caller has just published a cell with a sequentially consistent store, which pairs with the waiter
+ * registering itself before its last attempt, so either the waiter sees the cell or we see the waiter
+ * @param word The futex word to bump
+ * @param waiters The number of threads sleeping on word
+ */
+static inline void ring_notify(unsigned *word, unsigned *waiters) {
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST)) {
+        __atomic_fetch_add(word, 1, __ATOMIC_SEQ_CST);
+        futex_wake(word, 1);
+    }
+}
+
+/**
+ * Try to add an item at the tail of the ring without blocking
+ * @param q A pointer to a ring
+ * @param value The item to be added
+ * @return 1 if the item is added, 0 if the ring is full
+ */
+int ring_try_enqueue(ring_t *q, void *value) {
+    ring_cell_t *cell;
+    unsigned long pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        long dif = (long)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (long)pos;
+        if (dif == 0) { // the cell is free in this lap, claim the position
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) { // the cell still holds the item of the previous lap
+            return 0;
+        } else { // another producer took the position
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+    cell->value = value;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_SEQ_CST);
+    ring_notify(&q->not_empty, &q->empty_waiters);
+    return 1;
+}
+
+/**
+ * Try to remove the item at the head of the ring without blocking
+ * @param q A pointer to a ring
+ * @param value Output of the removed item
+ * @return 1 if an item is removed, 0 if the ring is empty
+ */
+int ring_try_dequeue(ring_t *q, void **value) {
+    ring_cell_t *cell;
+    unsigned long pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        long dif = (long)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (long)(pos + 1);
+        if (dif == 0) { // the cell is filled in this lap, claim the position
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) { // the producer of this position has not finished
+            return 0;
+        } else { // another consumer took the position
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+    *value = cell->value;
+    __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_SEQ_CST); // free the cell for the next lap
+    ring_notify(&q->not_full, &q->full_waiters);
+    return 1;
+}
+
+/**
+ * Add an item at the tail of the ring, waiting while the ring is full
+ * Spin for RING_SPIN attempts first, then sleep until a consumer frees a cell
+ * @param q A pointer to a ring
+ * @param value The item to be added
+ */
+void ring_enqueue(ring_t *q, void *value) {
+    int i;
+    for (;;) {
+        for (i = 0; i < RING_SPIN; i++) {
+            if (ring_try_enqueue(q, value)) {
+                return;
+            }
+            cpu_pause();
+        }
+        unsigned seen = __atomic_load_n(&q->not_full, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&q->full_waiters, 1, __ATOMIC_SEQ_CST);
+        if (ring_try_enqueue(q, value)) {
+            __atomic_fetch_sub(&q->full_waiters, 1, __ATOMIC_SEQ_CST);
+            return;
+        }
+        futex_wait(&q->not_full, seen);
+        __atomic_fetch_sub(&q->full_waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * Remove the item at the head of the ring, waiting while the ring is empty
+ * Spin for RING_SPIN attempts first, then sleep until a producer adds an item
+ * @param q A pointer to a ring
+ * @return The removed item
+ */
+void *ring_dequeue(ring_t *q) {
+    int i;
+    void *value;
+    for (;;) {
+        for (i = 0; i < RING_SPIN; i++) {
+            if (ring_try_dequeue(q, &value)) {
+                return value;
+            }
+            cpu_pause();
+        }
+        unsigned seen = __atomic_load_n(&q->not_empty, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&q->empty_waiters, 1, __ATOMIC_SEQ_CST);
+        if (ring_try_dequeue(q, &value)) {
+            __atomic_fetch_sub(&q->empty_waiters, 1, __ATOMIC_SEQ_CST);
+            return value;
+        }
+        futex_wait(&q->not_empty, seen);
+        __atomic_fetch_sub(&q->empty_waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * Destroy the given ring, items still in it are dropped
+ * @param q The ring to be destroyed
+ */
+void ring_destroy(ring_t *q) {
+    free(q->cells);
+    q->cells = NULL;
+}
+
+/**
+ * Initialize the given queue with a dummy node
+ * @param q A pointer to a queue
+ */
+void msqueue_init(msqueue_t *q) {
+    msq_node_t *dummy = malloc(sizeof(msq_node_t));
+    dummy->value = NULL;
+    dummy->next = NULL;
+    q->head = dummy;
+    q->tail = dummy;
+    twophase_init(&q->head_lock);
+    twophase_init(&q->tail_lock);
+}
+
+/**
+ * Add an item at the tail of the queue
+ * @param q A pointer to a queue
+ * @param value The item to be added
+ */
+void msqueue_enqueue(msqueue_t *q, void *value) {
+    msq_node_t *node = malloc(sizeof(msq_node_t));
+    node->value = value;
+    node->next = NULL;
+    twophase_acquire(&q->tail_lock);
+    __atomic_store_n(&q->tail->next, node, __ATOMIC_RELEASE); // dequeuers read next under the other lock
+    q->tail = node;
+    twophase_release(&q->tail_lock);
+}
+
+/**
+ * Remove the item at the head of the queue
+ * The first item node becomes the new dummy, the old dummy is freed after the lock is released
+ * @param q A pointer to a queue
+ * @param value Output of the removed item
+ * @return 1 if an item is removed, 0 if the queue is empty
+ */
+int msqueue_dequeue(msqueue_t *q, void **value) {
+    twophase_acquire(&q->head_lock);
+    msq_node_t *dummy = q->head;
+    msq_node_t *first = __atomic_load_n(&dummy->next, __ATOMIC_ACQUIRE);
+    if (first == NULL) {
+        twophase_release(&q->head_lock);
+        return 0;
+    }
+    *value = first->value;
+    q->head = first;
+    twophase_release(&q->head_lock);
+    free(dummy);
+    return 1;
+}
+
+/**
+ * Destroy the given queue, items still in it are dropped
+ * @param q The queue to be destroyed
+ */
+void msqueue_destroy(msqueue_t *q) {
+    msq_node_t *cur = q->head;
+    while (cur != NULL) {
+        msq_node_t *next = cur->next;
+        free(cur);
+        cur = next;
+    }
+    q->head = NULL;
+    q->tail = NULL;
+}
@@ -0,0 +1,65 @@
+#ifndef P4_QUEUE_H
+#define P4_QUEUE_H
+
+#include "lock.h"
+#include <stdlib.h>
+
+/**
+ * A cell of the ring, seq tells which lap of the ring may use it next
+ * seq == pos means free for the producer at pos, seq == pos + 1 means filled for the consumer at pos
+ */
+typedef struct {
+    unsigned long seq; /**< sequence number of the cell */
+    void *value;       /**< the item stored in the cell */
+} ring_cell_t;
+
+/**
+ * A bounded multi-producer multi-consumer queue
+ * Producers and consumers claim positions with a cmpxchg on their own end and never take a lock,
+ * the blocking operations spin for a while and then sleep on a futex until the queue changes
+ * All operations except initialization and destroy are thread-safe
+ */
+typedef struct {
+    ring_cell_t *cells;     /**< the cells, capacity is a power of two */
+    unsigned long mask;     /**< capacity - 1 */
+    unsigned long head __attribute__((aligned(64))); /**< the next position to enqueue */
+    unsigned long tail __attribute__((aligned(64))); /**< the next position to dequeue */
+    unsigned not_full __attribute__((aligned(64))); /**< futex word bumped when space is freed for sleeping producers */
+    unsigned full_waiters;  /**< the number of producers sleeping on not_full */
+    unsigned not_empty;     /**< futex word bumped when an item is added for sleeping consumers */
+    unsigned empty_waiters; /**< the number of consumers sleeping on not_empty */
+} ring_t;
+
+int ring_init(ring_t *q, unsigned int capacity);
+int ring_try_enqueue(ring_t *q, void *value);
+int ring_try_dequeue(ring_t *q, void **value);
+void ring_enqueue(ring_t *q, void *value);
+void *ring_dequeue(ring_t *q);
+void ring_destroy(ring_t *q);
+
+/**
+ * Node type in the Michael-Scott queue
+ */
+typedef struct _msq_node_t {
+    void *value;               /**< the item stored in the node */
+    struct _msq_node_t *next;  /**< pointer to the next node towards the tail */
+} msq_node_t;
+
+/**
+ * An unbounded two-lock queue (Michael and Scott)
+ * The head always points to a dummy node, so enqueuers only take the tail lock and dequeuers only the head lock
+ * All operations except initialization and destroy are thread-safe
+ */
+typedef struct {
+    msq_node_t *head;                                  /**< the dummy node, its successor is the first item */
+    twophase_t head_lock;                              /**< serialize dequeuers */
+    msq_node_t *tail __attribute__((aligned(64)));     /**< the last node */
+    twophase_t tail_lock;                              /**< serialize enqueuers */
+} msqueue_t;
+
+void msqueue_init(msqueue_t *q);
+void msqueue_enqueue(msqueue_t *q, void *value);
+int msqueue_dequeue(msqueue_t *q, void **value);
+void msqueue_destroy(msqueue_t *q);
+
+#endif //P4_QUEUE_H
@@ -0,0 +1,224 @@
+#include "rng.h"
+#include <math.h>
+
+const char *dist_names[DIST_COUNT] = {"uniform", "zipf", "hotspot", "sequential", "latest"};
+
+/**
+ * One step of splitmix64, used to expand a seed into the xoshiro state
+ * @param x A pointer to the splitmix state
+ * @return 64 well mixed bits
+ */
+static unsigned long long splitmix64(unsigned long long *x) {
+    unsigned long long z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Seed a generator, different seeds give independent looking streams
+ * @param rng A pointer to the generator
+ * @param seed Any 64-bit value
+ */
+void rng_seed(rng_t *rng, unsigned long long seed) {
+    int i;
+    for (i = 0; i < 4; i++) {
+        rng->s[i] = splitmix64(&seed);
+    }
+}
+
+/**
+ * Get a random double in [0, 1)
+ * @param rng A pointer to the generator
+ * @return A random double with 53 random bits
+ */
+double rng_double(rng_t *rng) {
+    return (rng_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * (e^x - 1) / x, continued to 1 at x = 0
+ */
+static double zipf_expm1_ratio(double x) {
+    return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x * 0.5 * (1 + x / 3 * (1 + 0.25 * x));
+}
+
+/**
+ * log(1 + x) / x, continued to 1 at x = 0
+ */
+static double zipf_log1p_ratio(double x) {
+    return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+}
+
+/**
+ * The hat function h(x) = x^-theta of rejection inversion
+ */
+static double zipf_h(double theta, double x) {
+    return exp(-theta * log(x));
+}
+
+/**
+ * H(x), an integral of h, written so that it stays exact as theta approaches 1
+ */
+static double zipf_h_integral(double theta, double x) {
+    double log_x = log(x);
+    return zipf_expm1_ratio((1 - theta) * log_x) * log_x;
+}
+
+/**
+ * The inverse of H
+ */
+static double zipf_h_integral_inverse(double theta, double x) {
+    double t = x * (1 - theta);
+    if (t < -1) { // only reachable through rounding
+        t = -1;
+    }
+    return exp(zipf_log1p_ratio(t) * x);
+}
+
+/**
+ * Initialize a key distribution
+ * Below a skew of 1 the zipfian constants follow Gray et al. "Quickly generating billion-record synthetic databases"
+ * like YCSB, computing zeta(range) is O(range) and done only once here
+ * From a skew of 1 on that approximation breaks down, ranks are drawn by rejection inversion instead
+ * (Hormann and Derflinger, "Rejection-inversion to generate variates from monotone discrete distributions"),
+ * which is exact and needs no zeta
+ * @param dist The distribution to be initialized
+ * @param type The distribution type
+ * @param range Keys are drawn from [0, range)
+ * @param theta The zipfian skew for DIST_ZIPF and DIST_LATEST, greater than 0
+ * @param hot_keys The fraction of hot keys for DIST_HOTSPOT
+ * @param hot_ops The fraction of accesses that go to hot keys for DIST_HOTSPOT
+ */
+void keydist_init(keydist_t *dist, dist_type_t type, unsigned int range, double theta, double hot_keys, double hot_ops) {
+    unsigned int i;
+    dist->type = type;
+    dist->range = range;
+    dist->theta = theta;
+    dist->hot_keys = hot_keys;
+    dist->hot_ops = hot_ops;
+    dist->zetan = 0;
+    dist->alpha = dist->eta = dist->half_pow_theta = 0;
+    dist->h_x1 = dist->h_n = dist->squeeze = 0;
+    if ((type == DIST_ZIPF || type == DIST_LATEST) && theta >= 1) {
+        dist->h_x1 = zipf_h_integral(theta, 1.5) - 1;
+        dist->h_n = zipf_h_integral(theta, range + 0.5);
+        dist->squeeze = 2 - zipf_h_integral_inverse(theta, zipf_h_integral(theta, 2.5) - zipf_h(theta, 2));
+    } else if (type == DIST_ZIPF || type == DIST_LATEST) {
+        double zeta2 = 1 + pow(0.5, theta);
+        for (i = 1; i <= range; i++) {
+            dist->zetan += 1 / pow(i, theta);
+        }
+        dist->alpha = 1 / (1 - theta);
+        dist->eta = (1 - pow(2.0 / range, 1 - theta)) / (1 - zeta2 / dist->zetan);
+        dist->half_pow_theta = pow(0.5, theta);
+    }
+}
+
+/**
+ * Initialize the key generator of one thread
+ * @param gen The generator to be initialized
+ * @param dist The shared distribution
+ * @param seed The workload seed
+ * @param id The thread index, mixed into the seed, used as the sequential start point and the latest key offset
+ * @param threads The number of threads sharing the distribution
+ */
+void keygen_init(keygen_t *gen, keydist_t *dist, unsigned long long seed, int id, int threads) {
+    rng_seed(&gen->rng, seed * 0x100000001b3ULL + (unsigned long long)id);
+    gen->dist = dist;
+    gen->cursor = (unsigned int)((unsigned long long)dist->range * id / (threads > 0 ? threads : 1));
+    gen->latest = 0;
+    gen->id = (unsigned int)id;
+    gen->threads = threads > 0 ? (unsigned int)threads : 1;
+}
+
+/**
+ * Draw a zipfian rank in [0, range) by rejection inversion, for skews of 1 and above
+ * A point is drawn under the integral of the hat function and inverted to a rank,
+ * which is accepted unless the point falls between the hat and the distribution, less than once in a few draws
+ */
+static unsigned int keygen_zipf_rejection(keygen_t *gen) {
+    keydist_t *dist = gen->dist;
+    for (;;) {
+        double u = dist->h_n + rng_double(&gen->rng) * (dist->h_x1 - dist->h_n);
+        double x = zipf_h_integral_inverse(dist->theta, u);
+        double k = floor(x + 0.5);
+        if (k < 1) {
+            k = 1;
+        } else if (k > dist->range) {
+            k = dist->range;
+        }
+        if (k - x <= dist->squeeze || u >= zipf_h_integral(dist->theta, k + 0.5) - zipf_h(dist->theta, k)) {
+            return (unsigned int)k - 1;
+        }
+    }
+}
+
+/**
+ * Draw a zipfian rank in [0, range), rank 0 is the most popular
+ */
+static unsigned int keygen_zipf(keygen_t *gen) {
+    keydist_t *dist = gen->dist;
+    if (dist->theta >= 1) {
+        return keygen_zipf_rejection(gen);
+    }
+    double u = rng_double(&gen->rng);
+    double uz = u * dist->zetan;
+    if (uz < 1) {
+        return 0;
+    }
+    if (uz < 1 + dist->half_pow_theta) {
+        return 1 < dist->range ? 1 : 0;
+    }
+    unsigned int rank = (unsigned int)(dist->range * pow(dist->eta * u - dist->eta + 1, dist->alpha));
+    return rank < dist->range ? rank : dist->range - 1;
+}
+
+/**
+ * Draw the key of a lookup or delete
+ * @param gen The generator of calling thread
+ * @return A key in [0, range)
+ */
+unsigned int keygen_next(keygen_t *gen) {
+    keydist_t *dist = gen->dist;
+    switch (dist->type) {
+        case DIST_ZIPF:
+            return keygen_zipf(gen);
+        case DIST_HOTSPOT: {
+            unsigned int hot = (unsigned int)(dist->range * dist->hot_keys);
+            if (hot == 0 || hot >= dist->range) {
+                return rng_below(&gen->rng, dist->range);
+            }
+            if (rng_double(&gen->rng) < dist->hot_ops) {
+                return rng_below(&gen->rng, hot);
+            }
+            return hot + rng_below(&gen->rng, dist->range - hot);
+        }
+        case DIST_SEQUENTIAL: {
+            unsigned int key = gen->cursor;
+            gen->cursor = gen->cursor + 1 < dist->range ? gen->cursor + 1 : 0;
+            return key;
+        }
+        case DIST_LATEST: { // rank 0 is the newest key of this thread, ranks count back through all threads' keys
+            unsigned long long next = (gen->latest * gen->threads + gen->id) % dist->range;
+            unsigned long long back = gen->threads % dist->range + keygen_zipf(gen) % dist->range;
+            return (unsigned int)((next + 2ULL * dist->range - back) % dist->range);
+        }
+        default:
+            return rng_below(&gen->rng, dist->range);
+    }
+}
+
+/**
+ * Draw the key of an insert
+ * For DIST_LATEST, thread id of T inserts keys id, id + T, id + 2T, ... so the threads together insert increasing
+ * keys without sharing a counter, as long as they insert at similar rates
+ * @param gen The generator of calling thread
+ * @return A key in [0, range)
+ */
+unsigned int keygen_next_insert(keygen_t *gen) {
+    if (gen->dist->type == DIST_LATEST) {
+        return (unsigned int)((gen->latest++ * gen->threads + gen->id) % gen->dist->range);
+    }
+    return keygen_next(gen);
+}
@@ -0,0 +1,98 @@
+#ifndef P4_RNG_H
+#define P4_RNG_H
+
+/**
+ * A per-thread xoshiro256** pseudo random generator
+ * Unlike rand(), it has no shared state and no lock, each thread should own one
+ */
+typedef struct {
+    unsigned long long s[4]; /**< the generator state, must not be all zero */
+} rng_t;
+
+/**
+ * The key distributions a workload can draw keys from
+ */
+typedef enum {
+    DIST_UNIFORM = 0, /**< every key in range is equally likely */
+    DIST_ZIPF,        /**< key i has probability proportional to 1 / (i + 1)^theta, for any theta > 0 */
+    DIST_HOTSPOT,     /**< hot_ops of accesses go to the first hot_keys of the range */
+    DIST_SEQUENTIAL,  /**< every thread walks the range in order from its own start point */
+    DIST_LATEST,      /**< inserts take increasing keys, other accesses are zipfian around the newest insert of the thread */
+    DIST_COUNT
+} dist_type_t;
+
+extern const char *dist_names[DIST_COUNT];
+
+/**
+ * A key distribution shared by all threads of a workload
+ * The zipfian constants are precomputed once by keydist_init, skews below 1 use the YCSB constants,
+ * skews of 1 and above use those of rejection inversion
+ */
+typedef struct {
+    dist_type_t type;        /**< the distribution type */
+    unsigned int range;      /**< keys are drawn from [0, range) */
+    double theta;            /**< the zipfian skew, greater than 0 */
+    double hot_keys;         /**< the fraction of keys that are hot, for DIST_HOTSPOT */
+    double hot_ops;          /**< the fraction of accesses that go to hot keys, for DIST_HOTSPOT */
+    double zetan;            /**< zeta(range, theta) */
+    double alpha;            /**< 1 / (1 - theta) */
+    double eta;              /**< the YCSB eta constant */
+    double half_pow_theta;   /**< 0.5^theta */
+    double h_x1;             /**< H(1.5) - 1, the upper end of the rejection inversion range */
+    double h_n;              /**< H(range + 0.5), the lower end of the rejection inversion range */
+    double squeeze;          /**< ranks this close to the inverted point are accepted without testing */
+} keydist_t;
+
+/**
+ * Per-thread key generator state
+ */
+typedef struct {
+    rng_t rng;              /**< the thread's own random generator */
+    keydist_t *dist;        /**< the shared distribution */
+    unsigned int cursor;    /**< the next key for DIST_SEQUENTIAL */
+    unsigned long long latest; /**< the number of keys this thread inserted, for DIST_LATEST */
+    unsigned int id;        /**< the thread index, the offset of this thread's keys for DIST_LATEST */
+    unsigned int threads;   /**< the number of threads, the stride of each thread's keys for DIST_LATEST */
+} keygen_t;
+
+void rng_seed(rng_t *rng, unsigned long long seed);
+double rng_double(rng_t *rng);
+
+void keydist_init(keydist_t *dist, dist_type_t type, unsigned int range, double theta, double hot_keys, double hot_ops);
+void keygen_init(keygen_t *gen, keydist_t *dist, unsigned long long seed, int id, int threads);
+unsigned int keygen_next(keygen_t *gen);
+unsigned int keygen_next_insert(keygen_t *gen);
+
+static inline unsigned long long rng_rotl(unsigned long long x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+/**
+ * Get the next 64 random bits, kept inline since it sits in every benchmark loop
+ * @param rng A pointer to the generator
+ * @return 64 random bits
+ */
+static inline unsigned long long rng_next(rng_t *rng) {
+    unsigned long long *s = rng->s;
+    unsigned long long result = rng_rotl(s[1] * 5, 7) * 9;
+    unsigned long long t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotl(s[3], 45);
+    return result;
+}
+
+/**
+ * Get a random number in [0, n) by multiply-shift, avoiding the divide of a modulo
+ * @param rng A pointer to the generator
+ * @param n The exclusive upper bound
+ * @return A random number in [0, n)
+ */
+static inline unsigned int rng_below(rng_t *rng, unsigned int n) {
+    return (unsigned int)(((rng_next(rng) >> 32) * n) >> 32);
+}
+
+#endif //P4_RNG_H
@@ -0,0 +1,117 @@
+#ifndef P4_THASH_H
+#define P4_THASH_H
+
+#include "tlist.h"
+#include <stdio.h>
+
+/**
+ * The largest bucket size name_init accepts, rounding it up to a power of two must fit in an int
+ */
+#define THASH_MAX_BUCKETS (1 << 30)
+
+/**
+ * Type-specialized concurrent hash tables mapping keys to values
+ * THASH_DEFINE(name, key_type, value_type, hash, equal) generates a table type name_t whose buckets are
+ * TLIST_DEFINE lists named name_bucket_t, with the functions below
+ *     int       name_init(name_t *hash, int size)
+ *     int       name_put(name_t *hash, key_type key, value_type value)
+ *     int       name_get(name_t *hash, key_type key, value_type *value)
+ *     int       name_delete(name_t *hash, key_type key, value_type *value)
+ *     long long name_size(name_t *hash)
+ *     void      name_destroy(name_t *hash)
+ * hash(key) returns an unsigned int whose low bits select the bucket, equal(a, b) compares two keys,
+ * both are fixed at compile time and may be macros, so a lookup is one inlined hash, one bucket lock
+ * and one chain walk that copies the value out of the node
+ * All operations except initialize and destroy are thread-safe
+ */
+#define THASH_DEFINE(name, key_type, value_type, hash, equal) \
+\
+TLIST_DEFINE(name##_bucket, key_type, value_type, equal) \
+\
+typedef struct { \
+    name##_bucket_t *buckets; /**< the bucket lists */ \
+    unsigned int mask;        /**< bucket size - 1, the bucket size is a power of two */ \
+} name##_t; \
+\
+/** \
+ * Initialize the table, the bucket size is rounded up to a power of two \
+ * @return 0 on success, -1 if the size is not in [1, THASH_MAX_BUCKETS] or the allocation failed \
+ */ \
+static inline int name##_init(name##_t *table, int size) { \
+    unsigned int i, pow2 = 1; \
+    if (size < 1 || size > THASH_MAX_BUCKETS) { \
+        fprintf(stderr, "hash bucket size %d out of range!\n", size); \
+        return -1; \
+    } \
+    while ((int)pow2 < size) { \
+        pow2 <<= 1; \
+    } \
+    table->mask = pow2 - 1; \
+    table->buckets = malloc(sizeof(name##_bucket_t) * pow2); \
+    if (table->buckets == NULL) { \
+        perror("hash allocation failed!"); \
+        return -1; \
+    } \
+    for (i = 0; i < pow2; i++) { \
+        name##_bucket_init(&table->buckets[i]); \
+    } \
+    return 0; \
+} \
+\
+/** \
+ * Select the bucket of a key \
+ */ \
+static inline name##_bucket_t *name##_bucket(name##_t *table, key_type key) { \
+    return &table->buckets[(unsigned int)(hash(key)) & table->mask]; \
+} \
+\
+/** \
+ * Insert key with value, or replace the value if the key is present \
+ * @return 1 if the key is inserted, 0 if its value is replaced \
+ */ \
+static inline int name##_put(name##_t *table, key_type key, value_type value) { \
+    return name##_bucket_put(name##_bucket(table, key), key, value); \
+} \
+\
+/** \
+ * Look up key and copy its value out \
+ * @param value Output of the value, may be NULL to only test whether the key is present \
+ * @return 1 if the key is found, 0 otherwise \
+ */ \
+static inline int name##_get(name##_t *table, key_type key, value_type *value) { \
+    return name##_bucket_get(name##_bucket(table, key), key, value); \
+} \
+\
+/** \
+ * Delete key \
+ * @param value Output of the deleted value, may be NULL \
+ * @return 1 if the key is deleted, 0 if it is not found \
+ */ \
+static inline int name##_delete(name##_t *table, key_type key, value_type *value) { \
+    return name##_bucket_delete(name##_bucket(table, key), key, value); \
+} \
+\
+/** \
+ * Get the number of keys by summing the maintained bucket counts, O(bucket size) and without locks \
+ */ \
+static inline long long name##_size(name##_t *table) { \
+    unsigned int i; \
+    long long res = 0; \
+    for (i = 0; i <= table->mask; i++) { \
+        res += name##_bucket_count(&table->buckets[i]); \
+    } \
+    return res; \
+} \
+\
+/** \
+ * Destroy the table and free all nodes \
+ */ \
+static inline void name##_destroy(name##_t *table) { \
+    unsigned int i; \
+    for (i = 0; i <= table->mask; i++) { \
+        name##_bucket_destroy(&table->buckets[i]); \
+    } \
+    free(table->buckets); \
+}
+
+#endif //P4_THASH_H
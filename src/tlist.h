@@ -0,0 +1,172 @@
+#ifndef P4_TLIST_H
+#define P4_TLIST_H
+
+#include "lock.h"
+#include <stdlib.h>
+
+/**
+ * Type-specialized concurrent lists mapping keys to values
+ * TLIST_DEFINE(name, key_type, value_type, equal) generates a list type name_t with the functions below,
+ * all static inline so the key comparison is inlined and nothing is shared between instantiations
+ *     void name_init(name_t *list)
+ *     int  name_put(name_t *list, key_type key, value_type value)
+ *     int  name_get(name_t *list, key_type key, value_type *value)
+ *     int  name_delete(name_t *list, key_type key, value_type *value)
+ *     int  name_count(name_t *list)
+ *     void name_destroy(name_t *list)
+ * Keys are unique, the value lives in the node next to its key and is copied out under the lock,
+ * so a lookup is a single probe and the caller never holds a pointer into the list
+ * equal(a, b) compares two keys and returns non-zero if they are the same, it may be a macro
+ * Locking follows list.c: read-write locks search under the read or upgradable read end
+ */
+#define TLIST_DEFINE(name, key_type, value_type, equal) \
+\
+typedef struct name##_node_t { \
+    key_type key;                  /**< the key of this node */ \
+    struct name##_node_t *next;    /**< the next node in the list */ \
+    value_type value;              /**< the value stored with the key */ \
+} name##_node_t; \
+\
+typedef struct { \
+    name##_node_t *head; /**< the head node */ \
+    int size;            /**< the number of nodes, only written under the lock */ \
+    lock_t lock;         /**< protects the nodes */ \
+} name##_t; \
+\
+/** \
+ * Initialize the given list \
+ */ \
+static inline void name##_init(name##_t *list) { \
+    list->head = NULL; \
+    list->size = 0; \
+    lock_init(&list->lock); \
+} \
+\
+/** \
+ * Find the node with the given key and its predecessor, the caller must hold the lock \
+ */ \
+static inline name##_node_t *name##_find(name##_t *list, key_type key, name##_node_t **pre) { \
+    name##_node_t *cur = list->head; \
+    *pre = NULL; \
+    while (cur != NULL && !equal(cur->key, key)) { \
+        *pre = cur; \
+        cur = cur->next; \
+    } \
+    return cur; \
+} \
+\
+/** \
+ * Insert key with value at the head of the list, or replace the value if the key is present \
+ * Like list_insert_unique, the node is allocated before the lock unless the search runs under the upgradable end \
+ * @return 1 if the key is inserted, 0 if its value is replaced \
+ */ \
+static inline int name##_put(name##_t *list, key_type key, value_type value) { \
+    name##_node_t *pre, *cur; \
+    name##_node_t *new_node = TLIST_ALLOC_UNLOCKED ? malloc(sizeof(name##_node_t)) : NULL; \
+    TLIST_LOCK_UPGRADABLE(&list->lock); \
+    cur = name##_find(list, key, &pre); \
+    if (cur != NULL) { \
+        TLIST_LOCK_UPGRADE(&list->lock); \
+        cur->value = value; \
+        lock_release(&list->lock); \
+        free(new_node); \
+        return 0; \
+    } \
+    if (new_node == NULL) { \
+        new_node = malloc(sizeof(name##_node_t)); \
+    } \
+    new_node->key = key; \
+    new_node->value = value; \
+    TLIST_LOCK_UPGRADE(&list->lock); \
+    new_node->next = list->head; \
+    list->head = new_node; \
+    __atomic_store_n(&list->size, list->size + 1, __ATOMIC_RELAXED); \
+    lock_release(&list->lock); \
+    return 1; \
+} \
+\
+/** \
+ * Look up key and copy its value out \
+ * @param value Output of the value, may be NULL to only test whether the key is present \
+ * @return 1 if the key is found, 0 otherwise \
+ */ \
+static inline int name##_get(name##_t *list, key_type key, value_type *value) { \
+    name##_node_t *pre, *cur; \
+    TLIST_LOCK_READ(&list->lock); \
+    cur = name##_find(list, key, &pre); \
+    if (cur != NULL && value != NULL) { \
+        *value = cur->value; \
+    } \
+    lock_release(&list->lock); \
+    return cur != NULL; \
+} \
+\
+/** \
+ * Delete key, the node is freed after the lock is released \
+ * @param value Output of the deleted value, may be NULL \
+ * @return 1 if the key is deleted, 0 if it is not found \
+ */ \
+static inline int name##_delete(name##_t *list, key_type key, value_type *value) { \
+    name##_node_t *pre, *cur; \
+    TLIST_LOCK_UPGRADABLE(&list->lock); \
+    cur = name##_find(list, key, &pre); \
+    if (cur == NULL) { \
+        TLIST_UNLOCK_UPGRADABLE(&list->lock); \
+        return 0; \
+    } \
+    TLIST_LOCK_UPGRADE(&list->lock); \
+    if (pre != NULL) { \
+        pre->next = cur->next; \
+    } else { \
+        list->head = cur->next; \
+    } \
+    __atomic_store_n(&list->size, list->size - 1, __ATOMIC_RELAXED); \
+    lock_release(&list->lock); \
+    if (value != NULL) { \
+        *value = cur->value; \
+    } \
+    free(cur); \
+    return 1; \
+} \
+\
+/** \
+ * Get the number of keys, maintained by writers so it takes no lock \
+ */ \
+static inline int name##_count(name##_t *list) { \
+    return __atomic_load_n(&list->size, __ATOMIC_RELAXED); \
+} \
+\
+/** \
+ * Destroy the given list and free all nodes \
+ */ \
+static inline void name##_destroy(name##_t *list) { \
+    name##_node_t *cur = list->head; \
+    while (cur != NULL) { \
+        name##_node_t *next = cur->next; \
+        free(cur); \
+        cur = next; \
+    } \
+    list->head = NULL; \
+    list->size = 0; \
+}
+
+/**
+ * The lock ends used by the generated functions, read-write locks search under the read or upgradable read end
+ * and writers upgrade once they modify, other locks simply take the lock for the whole operation
+ * TLIST_ALLOC_UNLOCKED tells whether new nodes are allocated before taking the lock
+ */
+#if defined(LOCK_RWLOCK) || defined(LOCK_PRWLOCK)
+#define TLIST_LOCK_READ(lock) rwlock_rdlock(lock)
+#define TLIST_LOCK_UPGRADABLE(lock) rwlock_uplock(lock)
+#define TLIST_LOCK_UPGRADE(lock) rwlock_upgrade(lock)
+#define TLIST_UNLOCK_UPGRADABLE(lock) rwlock_upunlock(lock)
+#define TLIST_ALLOC_UNLOCKED 0
+#else
+#define TLIST_LOCK_READ(lock) lock_acquire(lock)
+#define TLIST_LOCK_UPGRADABLE(lock) lock_acquire(lock)
+#define TLIST_LOCK_UPGRADE(lock) do { } while (0)
+#define TLIST_UNLOCK_UPGRADABLE(lock) lock_release(lock)
+#define TLIST_ALLOC_UNLOCKED 1
+#endif
+
+#endif //P4_TLIST_H
@@ -0,0 +1,203 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Double the capacity of a record buffer
+ * @param buffer The buffer to grow
+ */
+void trace_buffer_grow(trace_buffer_t *buffer) {
+    buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+    buffer->records = realloc(buffer->records, sizeof(trace_record_t) * buffer->capacity);
+}
+
+/**
+ * Release the memory of a record buffer and empty it
+ * @param buffer The buffer to free
+ */
+void trace_buffer_free(trace_buffer_t *buffer) {
+    free(buffer->records);
+    buffer->records = NULL;
+    buffer->n = buffer->capacity = 0;
+}
+
+/**
+ * Order records by time, then by thread, so ties are broken the same way every time
+ */
+static int trace_record_cmp(const void *a, const void *b) {
+    const trace_record_t *x = a, *y = b;
+    if (x->time != y->time) {
+        return x->time < y->time ? -1 : 1;
+    }
+    return (int)x->thread - (int)y->thread;
+}
+
+/**
+ * Merge the buffers of all recording threads into a trace file sorted by time
+ * Times are rebased so that the first record is at 0
+ * @param path The path of the trace file, will be truncated
+ * @param buffers The per-thread buffers
+ * @param threads The number of buffers
+ * @return 0 on success, -1 on failure
+ */
+int trace_write(const char *path, trace_buffer_t *buffers, int threads) {
+    int i;
+    unsigned long long j, n = 0, first = ~0ULL;
+    trace_header_t header;
+    for (i = 0; i < threads; i++) {
+        n += buffers[i].n;
+    }
+    trace_record_t *records = malloc(sizeof(trace_record_t) * (n ? n : 1));
+    n = 0;
+    for (i = 0; i < threads; i++) {
+        for (j = 0; j < buffers[i].n; j++) {
+            records[n] = buffers[i].records[j];
+            if (records[n].time < first) {
+                first = records[n].time;
+            }
+            n++;
+        }
+    }
+    for (j = 0; j < n; j++) {
+        records[j].time -= first;
+    }
+    qsort(records, n, sizeof(trace_record_t), trace_record_cmp);
+
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.threads = (unsigned int)threads;
+    header.reserved = 0;
+    header.count = n;
+
+    int ret = 0;
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        perror("trace_write: fopen");
+        ret = -1;
+    } else {
+        if (fwrite(&header, sizeof(header), 1, file) != 1 || fwrite(records, sizeof(trace_record_t), n, file) != n) {
+            perror("trace_write: fwrite");
+            ret = -1;
+        }
+        if (fclose(file) != 0) {
+            perror("trace_write: fclose");
+            ret = -1;
+        }
+    }
+    free(records);
+    return ret;
+}
+
+/**
+ * Map a trace file read-only and validate its layout and operation types
+ * @param trace The trace to be opened
+ * @param path The path of the trace file
+ * @return 0 on success, -1 on failure
+ */
+int trace_open(trace_t *trace, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("trace_open: open");
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        perror("trace_open: fstat");
+        close(fd);
+        return -1;
+    }
+    if ((unsigned long)st.st_size < sizeof(trace_header_t)) {
+        fprintf(stderr, "trace_open: %s is too short\n", path);
+        close(fd);
+        return -1;
+    }
+    trace->length = (unsigned long)st.st_size;
+    trace->base = mmap(NULL, trace->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (trace->base == MAP_FAILED) {
+        perror("trace_open: mmap");
+        return -1;
+    }
+    madvise(trace->base, trace->length, MADV_SEQUENTIAL);
+
+    trace->header = trace->base;
+    trace->records = (const trace_record_t *)(trace->header + 1);
+    if (trace->header->magic != TRACE_MAGIC || trace->header->version != TRACE_VERSION
+        || trace->length != sizeof(trace_header_t) + sizeof(trace_record_t) * trace->header->count) {
+        fprintf(stderr, "trace_open: %s is not a valid trace\n", path);
+        munmap(trace->base, trace->length);
+        return -1;
+    }
+    unsigned long long j;
+    for (j = 0; j < trace->header->count; j++) {
+        if (trace->records[j].op > TRACE_DELETE) {
+            fprintf(stderr, "trace_open: record %llu of %s has unknown operation %u\n",
+                    j, path, (unsigned)trace->records[j].op);
+            munmap(trace->base, trace->length);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Unmap a trace
+ * @param trace A pointer to an opened trace
+ */
+void trace_close(trace_t *trace) {
+    munmap(trace->base, trace->length);
+    trace->base = NULL;
+}
+
+/**
+ * Split the records of a trace among replay threads
+ * Part r receives, in time order, the records of every recorded thread t with t % parts == r,
+ * so each replay thread only touches its own records
+ * @param trace An opened trace
+ * @param parts The number of replay threads
+ * @param out Output array of parts parts, free with trace_partition_free
+ * @return 0 on success, -1 on failure
+ */
+int trace_partition(const trace_t *trace, int parts, trace_part_t *out) {
+    int r;
+    unsigned long long j;
+    for (r = 0; r < parts; r++) {
+        out[r].records = NULL;
+        out[r].n = 0;
+    }
+    for (j = 0; j < trace->header->count; j++) {
+        out[trace->records[j].thread % parts].n++;
+    }
+    for (r = 0; r < parts; r++) {
+        out[r].records = malloc(sizeof(trace_record_t) * (out[r].n ? out[r].n : 1));
+        if (out[r].records == NULL) {
+            perror("trace_partition: malloc");
+            trace_partition_free(out, r);
+            return -1;
+        }
+        out[r].n = 0;
+    }
+    for (j = 0; j < trace->header->count; j++) {
+        trace_part_t *part = &out[trace->records[j].thread % parts];
+        part->records[part->n++] = trace->records[j];
+    }
+    return 0;
+}
+
+/**
+ * Release the parts made by trace_partition
+ * @param parts The parts
+ * @param n The number of parts
+ */
+void trace_partition_free(trace_part_t *parts, int n) {
+    int r;
+    for (r = 0; r < n; r++) {
+        free(parts[r].records);
+        parts[r].records = NULL;
+        parts[r].n = 0;
+    }
+}
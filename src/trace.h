@@ -0,0 +1,87 @@
+#ifndef P4_TRACE_H
+#define P4_TRACE_H
+
+#define TRACE_MAGIC 0x52543450 /**< "P4TR" in little endian */
+#define TRACE_VERSION 1
+
+/**
+ * Operation types stored in a trace, lookup/get, insert/increment and delete/decrement
+ */
+#define TRACE_READ 0
+#define TRACE_INSERT 1
+#define TRACE_DELETE 2
+
+/**
+ * The trace file layout, all fields are in host byte order
+ * header | trace_record_t records[count], sorted by time
+ */
+typedef struct {
+    unsigned int magic;         /**< TRACE_MAGIC */
+    unsigned int version;       /**< TRACE_VERSION */
+    unsigned int threads;       /**< the number of threads that were recorded */
+    unsigned int reserved;      /**< must be 0 */
+    unsigned long long count;   /**< the number of records */
+} trace_header_t;
+
+/**
+ * One recorded operation, 16 bytes
+ */
+typedef struct {
+    unsigned long long time; /**< nanoseconds since the first record */
+    unsigned int key;        /**< the key, 0 for counter operations */
+    unsigned short thread;   /**< the index of the recording thread */
+    unsigned char op;        /**< TRACE_READ, TRACE_INSERT or TRACE_DELETE */
+    unsigned char pad;       /**< must be 0 */
+} trace_record_t;
+
+/**
+ * A growable per-thread record buffer, only touched by its owner while recording
+ */
+typedef struct {
+    trace_record_t *records;      /**< the records */
+    unsigned long long n;         /**< the number of records */
+    unsigned long long capacity;  /**< the capacity of records */
+} trace_buffer_t;
+
+/**
+ * A trace file mapped read-only
+ */
+typedef struct {
+    void *base;                      /**< the start of the mapping */
+    unsigned long length;            /**< the length of the mapping */
+    const trace_header_t *header;    /**< the header at the start of the file */
+    const trace_record_t *records;   /**< the records following the header */
+} trace_t;
+
+/**
+ * The records one replay thread is responsible for, copied out of a trace in time order
+ */
+typedef struct {
+    trace_record_t *records; /**< the records */
+    unsigned long long n;    /**< the number of records */
+} trace_part_t;
+
+void trace_buffer_grow(trace_buffer_t *buffer);
+void trace_buffer_free(trace_buffer_t *buffer);
+int trace_write(const char *path, trace_buffer_t *buffers, int threads);
+int trace_open(trace_t *trace, const char *path);
+void trace_close(trace_t *trace);
+int trace_partition(const trace_t *trace, int parts, trace_part_t *out);
+void trace_partition_free(trace_part_t *parts, int n);
+
+/**
+ * Append a record to a thread's buffer, the time is absolute and rebased by trace_write
+ */
+static inline void trace_append(trace_buffer_t *buffer, unsigned long long time, int thread, int op, unsigned int key) {
+    if (buffer->n == buffer->capacity) {
+        trace_buffer_grow(buffer);
+    }
+    trace_record_t *record = &buffer->records[buffer->n++];
+    record->time = time;
+    record->key = key;
+    record->thread = (unsigned short)thread;
+    record->op = (unsigned char)op;
+    record->pad = 0;
+}
+
+#endif //P4_TRACE_H